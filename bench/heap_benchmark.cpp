@@ -0,0 +1,274 @@
+// Benchmarks of heap engines on several workloads, sizes and configurations
+//
+//     heap_benchmark [--max_size=n] [google benchmark flags]
+//
+// Engines are the buffer tree heap, sequence heap, radix heap and, as a baseline,
+// binary heap on pages behind the same node cache (paged_binary).
+// Benchmarks are named engine/workload/t:t/cache:cache_size/backend/size:size,
+// sizes are powers of ten from 10^3 up to max_size (10^6 by default, at most 10^8).
+// Besides time, block transfers (node loads and writes) per operation are reported
+// in total and by node type, next to the bound (1/B) log_{M/B}(N/B) of the buffer tree,
+// where B = 2 * t elements per node and M / B = cache size in nodes (3 for engines
+// without node cache).
+// Backends are memory, directory and memory behind a simulated hdd, ssd or nvme device,
+// for simulated devices the reported time is the running time plus the simulated time
+// of storage accesses.
+// Use --benchmark_filter to choose benchmarks and --benchmark_format=json or
+// --benchmark_out=file --benchmark_out_format=json for machine-readable results.
+
+#include <heap/heap.h>
+#include <heap/radix_heap.h>
+#include <heap/sequence_heap.h>
+#include <simple/paged_heap.h>
+#include <storage/memory.h>
+#include <storage/directory.h>
+#include <storage/counting.h>
+#include <storage/device.h>
+
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace
+{
+using buffer_tree_heap = data::heap<std::uint64_t, std::uint64_t>;
+using sequence_heap = data::sequence_heap<std::uint64_t, std::uint64_t>;
+using radix_heap = data::radix_heap<std::uint64_t, std::uint64_t>;
+using paged_heap = simple::paged_heap<std::uint64_t, std::uint64_t>;
+
+const fs::path storage_path = "heap_benchmark_storage";
+
+struct config
+{
+    std::string workload;
+    std::size_t t;
+    std::size_t cache_size;
+    std::string backend;
+    std::size_t size;
+};
+
+bool simulated(const std::string & backend)
+{
+    return backend == "hdd" || backend == "ssd" || backend == "nvme";
+}
+
+struct backend_storage
+{
+    backend_storage(const std::string & backend)
+    {
+        if (backend == "directory")
+        {
+            fs::remove_all(storage_path);
+            base.reset(new storage::directory<std::string>(storage_path));
+            return;
+        }
+
+        base.reset(new storage::memory<std::string>());
+        if (backend == "hdd")
+            device.reset(new storage::device<std::string>(*base, storage::device_profile::hdd()));
+        else if (backend == "ssd")
+            device.reset(new storage::device<std::string>(*base, storage::device_profile::sata_ssd()));
+        else if (backend == "nvme")
+            device.reset(new storage::device<std::string>(*base, storage::device_profile::nvme()));
+    }
+
+    storage::basic_storage<std::string> & get()
+    {
+        if (device)
+            return *device;
+        return *base;
+    }
+
+    std::unique_ptr<storage::basic_storage<std::string>> base;
+    std::unique_ptr<storage::device<std::string>> device;
+};
+
+std::unique_ptr<buffer_tree_heap> make_heap(storage::basic_storage<std::string> & storage, const config & c,
+                                            buffer_tree_heap *)
+{
+    return std::unique_ptr<buffer_tree_heap>(new buffer_tree_heap(storage, c.t, c.cache_size));
+}
+
+std::unique_ptr<sequence_heap> make_heap(storage::basic_storage<std::string> & storage, const config & c,
+                                         sequence_heap *)
+{
+    return std::unique_ptr<sequence_heap>(new sequence_heap(storage, c.t));
+}
+
+std::unique_ptr<radix_heap> make_heap(storage::basic_storage<std::string> & storage, const config & c,
+                                      radix_heap *)
+{
+    return std::unique_ptr<radix_heap>(new radix_heap(storage, c.t));
+}
+
+std::unique_ptr<paged_heap> make_heap(storage::basic_storage<std::string> & storage, const config & c,
+                                      paged_heap *)
+{
+    return std::unique_ptr<paged_heap>(new paged_heap(storage, c.t, c.cache_size));
+}
+
+// Keys added to the heap before elements are removed
+std::vector<std::uint64_t> generate_keys(const std::string & workload, std::size_t size)
+{
+    std::vector<std::uint64_t> keys(size);
+    std::mt19937_64 generator;
+    for (std::size_t i = 0; i < size; ++i)
+        if (workload == "ascending")
+            keys[i] = i;
+        else if (workload == "descending")
+            keys[i] = size - i;
+        else
+            keys[i] = generator() % (size * 16);
+    return keys;
+}
+
+// Run workload on the heap, return the number of operations
+// All workloads fill the heap with keys and then:
+// ascending, descending, random: remove elements one by one;
+// hold: replace the minimal element by a bigger one size times and then remove all;
+// batched: remove elements by batches of 1024.
+template <typename Heap>
+std::size_t run(Heap & heap, const std::string & workload, const std::vector<std::uint64_t> & keys)
+{
+    for (std::size_t i = 0; i < keys.size(); ++i)
+        heap.add(keys[i], i);
+
+    std::size_t operations = 2 * keys.size();
+    if (workload == "hold")
+    {
+        std::mt19937_64 generator;
+        for (std::size_t i = 0; i < keys.size(); ++i)
+        {
+            auto x = heap.remove_min();
+            heap.add(x.first + generator() % (keys.size() * 16), x.second);
+        }
+        operations += 2 * keys.size();
+    }
+
+    if (workload == "batched")
+    {
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> batch;
+        while (!heap.empty())
+        {
+            batch.clear();
+            heap.remove_min(1024, std::back_inserter(batch));
+            benchmark::DoNotOptimize(batch.data());
+        }
+    }
+    else
+        while (!heap.empty())
+            benchmark::DoNotOptimize(heap.remove_min());
+
+    return operations;
+}
+
+// Block transfers per operation of the buffer tree
+double io_bound(const config & c)
+{
+    double block = 2 * c.t;
+    double blocks_in_memory = std::max<std::size_t>(c.cache_size == 0 ? 3 : c.cache_size, 2);
+    return std::log(std::max(1.0, c.size / block)) / std::log(blocks_in_memory) / block;
+}
+
+template <typename Heap>
+void benchmark_heap(benchmark::State & state, config c)
+{
+    auto keys = generate_keys(c.workload, c.size);
+    std::size_t operations = 0;
+    std::map<std::string, storage::io_counters> ios;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        backend_storage storage(c.backend);
+        storage::counting<std::string> counted(storage.get(), bptree::classify);
+        auto heap = make_heap(counted, c, static_cast<Heap *>(nullptr));
+        state.ResumeTiming();
+
+        auto start = std::chrono::steady_clock::now();
+        operations += run(*heap, c.workload, keys);
+        auto end = std::chrono::steady_clock::now();
+
+        state.PauseTiming();
+        heap.reset();
+        for (auto & x : counted.by_kind())
+            ios[x.first.type] += x.second;
+        if (storage.device)
+            state.SetIterationTime(std::chrono::duration<double>(end - start + storage.device->elapsed()).count());
+        fs::remove_all(storage_path);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(operations);
+
+    storage::io_counters total;
+    for (auto & x : ios)
+    {
+        total += x.second;
+        state.counters[x.first + "_ios_per_op"] = double(x.second.ios()) / operations;
+    }
+    state.counters["ios_per_op"] = double(total.ios()) / operations;
+    state.counters["bytes_per_op"] = double(total.bytes_loaded + total.bytes_written) / operations;
+    state.counters["bound_per_op"] = io_bound(c);
+}
+
+template <typename Heap>
+void register_engine(const std::string & engine, const config & c)
+{
+    std::string name = engine + "/" + c.workload + "/t:" + std::to_string(c.t);
+    if (std::is_same<Heap, buffer_tree_heap>::value || std::is_same<Heap, paged_heap>::value)
+        name += "/cache:" + std::to_string(c.cache_size);
+    name += "/" + c.backend + "/size:" + std::to_string(c.size);
+    auto benchmark = benchmark::RegisterBenchmark(name.c_str(), benchmark_heap<Heap>, c);
+    benchmark->Unit(benchmark::kMillisecond);
+    if (simulated(c.backend))
+        benchmark->UseManualTime();
+}
+
+void register_benchmarks(std::size_t max_size)
+{
+    for (std::string workload : { "ascending", "descending", "random", "hold", "batched" })
+        for (std::size_t t : { 3, 16, 64 })
+            for (std::string backend : { "memory", "directory", "hdd", "ssd", "nvme" })
+                for (std::size_t size = 1000; size <= max_size; size *= 10)
+                {
+                    for (std::size_t cache_size : { 3, 64 })
+                    {
+                        register_engine<buffer_tree_heap>("buffer_tree", { workload, t, cache_size, backend, size });
+                        register_engine<paged_heap>("paged_binary", { workload, t, cache_size, backend, size });
+                    }
+                    register_engine<sequence_heap>("sequence", { workload, t, 0, backend, size });
+                    // All workloads remove keys in ascending order, so they suit the radix heap
+                    register_engine<radix_heap>("radix", { workload, t, 0, backend, size });
+                }
+}
+}
+
+int main(int argc, char ** argv)
+{
+    std::size_t max_size = 1000000;
+    const char max_size_flag[] = "--max_size=";
+    int remaining = 1;
+    for (int i = 1; i < argc; ++i)
+        if (std::strncmp(argv[i], max_size_flag, sizeof(max_size_flag) - 1) == 0)
+            max_size = std::min<std::size_t>(std::stoull(argv[i] + sizeof(max_size_flag) - 1), 100000000);
+        else
+            argv[remaining++] = argv[i];
+    argc = remaining;
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    register_benchmarks(max_size);
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,298 @@
+// Large scale run of a heap engine under a memory cap
+//
+//     scale [--engine heap|sequence|radix|paged] [--size n] [--workload random|ascending]
+//           [--memory bytes] [--rlimit bytes] [--storage directory|memory] [--path dir]
+//           [--t t] [--report n]
+//
+// size elements (up to 10^9) are added to an empty heap and then removed, every
+// report operations a line with throughput of the last interval, peak RSS and bytes
+// written to and loaded from the storage is printed, so changes of throughput while
+// the heap grows are visible.
+// memory is a byte budget of the engine's own buffers: it sets the node cache and
+// the small set of the buffer tree heap, the page cache of the paged binary heap and
+// the insertion heap of the sequence heap; radix heap has no such buffers.
+// rlimit caps the address space of the process with setrlimit, allocation failure
+// stops the run.
+// Directory storage is a new subdirectory of path, which is removed after the run.
+// If probes are compiled in (cmake -DHEAP_PROBES=ON), latency percentiles of heap
+// operations and tree events and sizes of flushes, spills and refills are printed
+// at the end.
+
+#include <heap/heap.h>
+#include <heap/radix_heap.h>
+#include <heap/sequence_heap.h>
+#include <simple/paged_heap.h>
+#include <storage/memory.h>
+#include <storage/directory.h>
+#include <storage/counting.h>
+#include <utils/probe.h>
+#include <utils/temp_directory.h>
+
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+using element = std::pair<std::uint64_t, std::uint64_t>;
+
+struct options
+{
+    std::string engine = "heap";
+    std::size_t size = 1000000;
+    std::string workload = "random";
+    std::size_t memory = 16 << 20;
+    std::size_t rlimit = 0;
+    std::string storage = "directory";
+    fs::path path = "scale_storage";
+    std::size_t t = 64;
+    std::size_t report = 0;
+};
+
+std::size_t peak_rss()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    // Kilobytes on Linux
+    return std::size_t(usage.ru_maxrss) * 1024;
+}
+
+// Prints a line every report operations
+struct reporter
+{
+    reporter(const options & o, const storage::counting<std::string> & counted)
+        : report(o.report)
+        , counted(counted)
+        , operations(0)
+        , start(std::chrono::steady_clock::now())
+        , last(start)
+        , last_operations(0)
+    {
+        std::cout << "phase\toperations\tseconds\toperations/s\tpeak_rss_mb\twritten_mb\tloaded_mb" << std::endl;
+    }
+
+    void operation(const char * phase)
+    {
+        if (++operations % report == 0)
+            print(phase);
+    }
+
+    void print(const char * phase)
+    {
+        auto now = std::chrono::steady_clock::now();
+        double interval = std::chrono::duration<double>(now - last).count();
+        auto ios = counted.total();
+        std::cout << phase << "\t" << operations
+                  << "\t" << std::chrono::duration<double>(now - start).count()
+                  << "\t" << (operations - last_operations) / std::max(interval, 1e-9)
+                  << "\t" << peak_rss() / 1e6
+                  << "\t" << ios.bytes_written / 1e6
+                  << "\t" << ios.bytes_loaded / 1e6 << std::endl;
+        last = now;
+        last_operations = operations;
+    }
+
+    std::size_t report;
+    const storage::counting<std::string> & counted;
+    std::size_t operations;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point last;
+    std::size_t last_operations;
+};
+
+// Fill the heap and remove all elements checking their order
+template <typename Heap>
+void fill_and_remove(const options & o, Heap & heap, reporter & r)
+{
+    std::mt19937_64 generator;
+    for (std::size_t i = 0; i < o.size; ++i)
+    {
+        heap.add(o.workload == "ascending" ? i : generator(), i);
+        r.operation("add");
+    }
+
+    std::uint64_t previous = 0;
+    std::size_t removed = 0;
+    while (!heap.empty())
+    {
+        auto x = heap.remove_min();
+        if (x.first < previous)
+            throw std::runtime_error("Elements are removed out of order");
+        previous = x.first;
+        ++removed;
+        r.operation("remove");
+    }
+    if (removed != o.size)
+        throw std::runtime_error("Wrong number of removed elements");
+    r.print("done");
+}
+
+void run(const options & o, storage::basic_storage<std::string> & storage, reporter & r)
+{
+    std::size_t node_size = 2 * o.t * sizeof(element);
+    if (o.engine == "sequence")
+    {
+        std::size_t insertion_size = std::max(2 * o.t, o.memory / 2 / sizeof(element));
+        data::sequence_heap<std::uint64_t, std::uint64_t> heap(storage, o.t, insertion_size);
+        fill_and_remove(o, heap, r);
+    }
+    else if (o.engine == "radix")
+    {
+        data::radix_heap<std::uint64_t, std::uint64_t> heap(storage, o.t);
+        fill_and_remove(o, heap, r);
+    }
+    else if (o.engine == "paged")
+    {
+        simple::paged_heap<std::uint64_t, std::uint64_t> heap(storage, o.t, std::max<std::size_t>(3, o.memory / node_size));
+        fill_and_remove(o, heap, r);
+    }
+    else
+    {
+        // Budget is split between the small set and the node cache by the heap
+        data::heap<std::uint64_t, std::uint64_t> heap(storage, o.t);
+        heap.set_memory_budget(o.memory);
+        fill_and_remove(o, heap, r);
+    }
+}
+
+void print_latencies()
+{
+    bool header = false;
+    for (std::size_t i = 0; i < static_cast<std::size_t>(utils::probe_event::count); ++i)
+    {
+        auto e = static_cast<utils::probe_event>(i);
+        auto h = utils::probe_histogram(e);
+        if (h.count() == 0)
+            continue;
+        if (!header)
+            std::cout << "event\tcount\tmean_us\tp50_us\tp99_us\tp99.9_us\tmax_us" << std::endl;
+        header = true;
+        std::cout << utils::probe_name(e) << "\t" << h.count() << "\t" << h.mean() / 1e3
+                  << "\t" << h.percentile(50) / 1e3 << "\t" << h.percentile(99) / 1e3
+                  << "\t" << h.percentile(99.9) / 1e3 << "\t" << h.max() / 1e3 << std::endl;
+    }
+
+    header = false;
+    for (std::size_t i = 0; i < static_cast<std::size_t>(utils::probe_event::count); ++i)
+    {
+        auto e = static_cast<utils::probe_event>(i);
+        auto h = utils::probe_size_histogram(e);
+        if (h.count() == 0)
+            continue;
+        if (!header)
+            std::cout << "event\tcount\tmean_elements\tp1\tp50\tp99\tmax" << std::endl;
+        header = true;
+        std::cout << utils::probe_name(e) << "\t" << h.count() << "\t" << h.mean()
+                  << "\t" << h.percentile(1) << "\t" << h.percentile(50) << "\t" << h.percentile(99)
+                  << "\t" << h.max() << std::endl;
+    }
+}
+
+void usage()
+{
+    std::cerr << "Usage: scale [--engine heap|sequence|radix|paged] [--size n] [--workload random|ascending]"
+              << " [--memory bytes] [--rlimit bytes] [--storage directory|memory] [--path dir]"
+              << " [--t t] [--report n]" << std::endl;
+}
+}
+
+int main(int argc, char ** argv)
+{
+    options o;
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (i + 1 == argc)
+                throw std::invalid_argument("Missing value of " + arg);
+
+            std::string value = argv[++i];
+            if (arg == "--engine")
+                o.engine = value;
+            else if (arg == "--size")
+                o.size = std::stoull(value);
+            else if (arg == "--workload")
+                o.workload = value;
+            else if (arg == "--memory")
+                o.memory = std::stoull(value);
+            else if (arg == "--rlimit")
+                o.rlimit = std::stoull(value);
+            else if (arg == "--storage")
+                o.storage = value;
+            else if (arg == "--path")
+                o.path = value;
+            else if (arg == "--t")
+                o.t = std::stoull(value);
+            else if (arg == "--report")
+                o.report = std::stoull(value);
+            else
+                throw std::invalid_argument("Unknown option " + arg);
+        }
+        if (o.size == 0 || o.size > 1000000000 || o.t < 2)
+            throw std::invalid_argument("Wrong arguments");
+        if (o.engine != "heap" && o.engine != "sequence" && o.engine != "radix" && o.engine != "paged")
+            throw std::invalid_argument("Unknown engine " + o.engine);
+        if (o.workload != "random" && o.workload != "ascending")
+            throw std::invalid_argument("Unknown workload " + o.workload);
+        if (o.storage != "memory" && o.storage != "directory")
+            throw std::invalid_argument("Unknown storage " + o.storage);
+    }
+    catch (std::exception & e)
+    {
+        std::cerr << e.what() << std::endl;
+        usage();
+        return 1;
+    }
+    if (o.report == 0)
+        o.report = std::max<std::size_t>(1, o.size / 10);
+
+    if (o.rlimit > 0)
+    {
+        rlimit limit;
+        limit.rlim_cur = limit.rlim_max = o.rlimit;
+        if (setrlimit(RLIMIT_AS, &limit) != 0)
+        {
+            std::cerr << "Can't set memory limit" << std::endl;
+            return 1;
+        }
+    }
+
+    std::unique_ptr<utils::temp_directory> temp;
+    std::unique_ptr<storage::basic_storage<std::string>> backend;
+    if (o.storage == "memory")
+        backend.reset(new storage::memory<std::string>());
+    else
+    {
+        temp.reset(new utils::temp_directory(o.path));
+        backend.reset(new storage::directory<std::string>(temp->path()));
+    }
+    storage::counting<std::string> counted(*backend, bptree::classify);
+    reporter r(o, counted);
+
+    int result = 0;
+    try
+    {
+        run(o, counted, r);
+        print_latencies();
+    }
+    catch (std::bad_alloc &)
+    {
+        std::cerr << "Out of memory after " << r.operations << " operations, peak RSS "
+                  << peak_rss() / 1e6 << " MB" << std::endl;
+        result = 2;
+    }
+    catch (std::exception & e)
+    {
+        std::cerr << e.what() << std::endl;
+        result = 1;
+    }
+    return result;
+}
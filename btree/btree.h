@@ -2,6 +2,7 @@
 
 #include "btree_data.h"
 #include "serialize.h"
+#include "shape.h"
 
 #include <vector>
 #include <map>
@@ -9,10 +10,16 @@
 #include <algorithm>
 #include <queue>
 #include <exception>
+#include <mutex>
+#include <shared_mutex>
+#include <array>
+#include <atomic>
+#include <string>
 
 #include <boost/optional.hpp>
 
 #include <storage/cache.h>
+#include <utils/probe.h>
 
 namespace detail
 {
@@ -22,6 +29,28 @@ enum struct result_tag
     CONTINUE_FROM
 };
 
+// Separator put into the parent between neighbour nodes, left_max < right_min:
+// every element of the left node is not greater than it and every element
+// of the right node is greater
+template <typename Key, typename Value>
+std::pair<Key, Value> separator(const std::pair<Key, Value> & left_max, const std::pair<Key, Value> &)
+{
+    return left_max;
+}
+
+// Shortest proper prefix of the right key that is greater than the left key if there is one,
+// so inner nodes keep short separators of long string keys
+template <typename Value>
+std::pair<std::string, Value> separator(const std::pair<std::string, Value> & left_max, const std::pair<std::string, Value> & right_min)
+{
+    const std::string & left = left_max.first, & right = right_min.first;
+    auto mismatch = std::mismatch(left.begin(), left.end(), right.begin(), right.end());
+    std::size_t n = mismatch.second - right.begin();
+    if (left < right && n + 1 < right.size())
+        return { right.substr(0, n + 1), left_max.second };
+    return left_max;
+}
+
 template <typename Key, typename Value, typename Serialized>
 struct b_internal;
 
@@ -99,7 +128,7 @@ struct b_node
 
     b_buffer<Key, Value, Serialized> parent_node() const
     {
-        assert(static_cast<bool>(*cached_this().parent_));
+        assert(static_cast<bool>(cached_this().parent_));
         return buffer_node(*cached_this().parent_);
     }
 
@@ -117,13 +146,25 @@ struct b_node
     // else return { CONTINUE_FROM, node that should be split first }
     virtual std::pair<result_tag, storage::node_id> split_full(size_t t, boost::optional<storage::node_id> & tree_root) = 0;
 
+    // Leaf of identical elements can't be split
+    virtual bool can_split() const
+    {
+        return true;
+    }
+
     // Ensure node is not too big
-    // If its size == 2 * t - 1, split node or someone above it and return parent of split node
+    // If its size >= 2 * t - 1, split node or someone above it and return parent of split node
     // else return boost::none
+    // If the node is the root of a latched subtree (tree_root points to a node with parent),
+    // it can't be split without touching the rest of the tree, so the node itself is returned
     boost::optional<storage::node_id> ensure_not_too_big(size_t t, boost::optional<storage::node_id> & tree_root)
     {
-        if (this->size() == 2 * t - 1)
+        if (this->size() >= 2 * t - 1 && can_split())
         {
+            if (tree_root && *tree_root == this->id_ && cached_this().parent_)
+                return this->id_;
+
+            HEAP_PROBE(split);
             auto r = split_full(t, tree_root);
             return r.second;
         }
@@ -169,8 +210,14 @@ struct b_node
     // else change tree structure and return root of the changed tree
     virtual boost::optional<storage::node_id> add(Key && key, Value && value, size_t t, boost::optional<storage::node_id> & tree_root) = 0;
 
-    // Remove left leaf from subtree and return values from it
-    virtual std::vector<std::pair<Key, Value> > remove_left_leaf(std::size_t t, boost::optional<storage::node_id> & tree_root) = 0;
+    // Remove pair(key, value) added to the tree earlier
+    // Buffers keep a tombstone of the pair until it meets the pending add of the pair
+    // or reaches a leaf. Tombstones don't trigger emptying of buffers, so tree structure
+    // is not changed and tombstones never pass pending adds of their pairs.
+    virtual void erase(Key && key, Value && value) = 0;
+
+    // Remove left (or right) leaf from subtree and return values from it
+    virtual std::vector<std::pair<Key, Value> > remove_leaf(bool left, std::size_t t, boost::optional<storage::node_id> & tree_root) = 0;
 };
 
 template <typename Key, typename Value, typename Serialized>
@@ -213,9 +260,18 @@ struct b_leaf : b_node<Key, Value, Serialized>
 
     virtual ~b_leaf() = default;
 
+    virtual bool can_split() const
+    {
+        auto & values = cached_this().values_;
+        return !values.empty() && !(values.front() == values.back());
+    }
+
+    // Leaf is split in the middle, or at the nearest place between different elements,
+    // so every element is routed to the leaf that holds it. Leaf of identical elements
+    // is not split and can grow beyond 2 * t - 1 elements
     virtual std::pair<result_tag, storage::node_id> split_full(size_t t, boost::optional<storage::node_id> & tree_root)
     {
-        assert(this->size() == 2 * t - 1);
+        assert(this->size() >= 2 * t - 1 && can_split());
 
         if (this->parent())
         {
@@ -231,16 +287,29 @@ struct b_leaf : b_node<Key, Value, Serialized>
         }
         storage::node_id brother = this->new_brother();
 
-        auto split_by_it = cached_this().values_.begin();
-        for (size_t i = 0; i < t - 1; ++i)
-            ++split_by_it;
+        auto & values = cached_this().values_;
+        std::size_t middle = values.size() / 2;
+        for (std::size_t d = 0; ; ++d)
+        {
+            if (middle >= d && middle - d > 0 && !(values[middle - d - 1] == values[middle - d]))
+            {
+                middle -= d;
+                break;
+            }
+            if (middle + d < values.size() && !(values[middle + d - 1] == values[middle + d]))
+            {
+                middle += d;
+                break;
+            }
+        }
+        auto split_by_it = values.begin() + middle;
 
         {
             // Insert new key after one pointing to x
             auto this_it = std::find(this->parent()->children_.begin(), this->parent()->children_.end(), this->id_);
             size_t this_i = this_it - this->parent()->children_.begin();
             auto this_key_it = this->parent()->keys_.begin() + this_i;
-            this->parent()->keys_.insert(this_key_it, split_by_it->first);
+            this->parent()->keys_.insert(this_key_it, separator(*std::prev(split_by_it), *split_by_it));
         }
 
         for (auto it = split_by_it; it != cached_this().values_.end(); ++it)
@@ -268,6 +337,14 @@ struct b_leaf : b_node<Key, Value, Serialized>
         return boost::none;
     }
 
+    virtual void erase(Key && key, Value && value)
+    {
+        auto v = std::make_pair(std::move(key), std::move(value));
+        auto it = std::lower_bound(cached_this().values_.begin(), cached_this().values_.end(), v);
+        if (it != cached_this().values_.end() && *it == v)
+            cached_this().values_.erase(it);
+    }
+
     // Remove this leaf from parent tree and return values from it
     std::vector<std::pair<Key, Value> > remove(std::size_t t, boost::optional<storage::node_id> & tree_root)
     {
@@ -275,10 +352,10 @@ struct b_leaf : b_node<Key, Value, Serialized>
         {
             assert(this->parent()->keys_.size() >= t || !this->parent()->parent_);
 
-            // Remove link to leaf from parent
+            // Remove link to leaf from parent, the last child is removed with the key before it
             auto it = std::find(this->parent()->children_.begin(), this->parent()->children_.end(), this->id_);
             std::size_t i = it - this->parent()->children_.begin();
-            this->parent()->keys_.erase(this->parent()->keys_.begin() + i);
+            this->parent()->keys_.erase(this->parent()->keys_.begin() + std::min(i, this->parent()->keys_.size() - 1));
             this->parent()->children_.erase(this->parent()->children_.begin() + i);
 
             // If parent became empty (that could only happen if it was root), make new root
@@ -298,13 +375,13 @@ struct b_leaf : b_node<Key, Value, Serialized>
         return cached_this().values_;
     }
 
-    virtual std::vector<std::pair<Key, Value> > remove_left_leaf(std::size_t t, boost::optional<storage::node_id> & tree_root)
+    virtual std::vector<std::pair<Key, Value> > remove_leaf(bool left, std::size_t t, boost::optional<storage::node_id> & tree_root)
     {
         if (cached_this().parent_)
         {
             auto r = this->parent_node().ensure_enough_keys(t, tree_root);
             if (r)
-                return this->buffer_node(*r).remove_left_leaf(t, tree_root);
+                return this->buffer_node(*r).remove_leaf(left, t, tree_root);
         }
 
         auto result = this->remove(t, tree_root);
@@ -397,8 +474,7 @@ struct b_internal : b_node<Key, Value, Serialized>
         if (r)
             return r;
 
-        auto it = std::lower_bound(cached_this().keys_.begin(), cached_this().keys_.end(), key);
-        std::size_t i = it - cached_this().keys_.begin();
+        std::size_t i = child_for(std::make_pair(key, value));
         storage::node_id child = cached_this().children_[i];
 
         r = detail::node_constructor(*this->storage_[child], this->storage_)
@@ -412,8 +488,24 @@ struct b_internal : b_node<Key, Value, Serialized>
         return this->add(std::move(key), std::move(value), t, tree_root);
     }
 
+    // Tombstone goes to the only child that can hold the element
+    virtual void erase(Key && key, Value && value)
+    {
+        std::size_t i = child_for(std::make_pair(key, value));
+        detail::node_constructor(*this->storage_[cached_this().children_[i]], this->storage_)
+                ->erase(std::move(key), std::move(value));
+    }
+
+    // Index of the child whose range contains x
+    std::size_t child_for(const std::pair<Key, Value> & x) const
+    {
+        auto & keys = cached_this().keys_;
+        return std::lower_bound(keys.begin(), keys.end(), x) - keys.begin();
+    }
+
     void merge_with_right_brother(std::size_t i, storage::node_id right_brother, std::size_t t, boost::optional<storage::node_id> & tree_root)
     {
+        HEAP_PROBE(merge);
         assert(cached_this().parent_ == this->storage_[right_brother]->parent_);
 
         assert(this->parent()->children_[i] == this->id_);
@@ -453,7 +545,7 @@ struct b_internal : b_node<Key, Value, Serialized>
 
     std::pair<result_tag, boost::optional<storage::node_id>> get_right_brother(size_t t, boost::optional<storage::node_id> & tree_root)
     {
-        assert(this->parent()->pending_add_.empty());
+        assert(!this->parent()->has_pending());
 
         auto it = std::find(this->parent()->children_.begin(), this->parent()->children_.end(), this->id_);
         std::size_t i = it - this->parent()->children_.begin();
@@ -462,7 +554,7 @@ struct b_internal : b_node<Key, Value, Serialized>
             return {result_tag::RESULT, boost::none};
 
         storage::node_id right_brother = this->parent()->children_[i + 1];
-        if (this->buffer(right_brother)->pending_add_.empty())
+        if (!this->buffer(right_brother)->has_pending())
             return {result_tag::RESULT, right_brother};
 
         // right brother may want to split, so
@@ -475,6 +567,23 @@ struct b_internal : b_node<Key, Value, Serialized>
         return {result_tag::RESULT, right_brother};
     }
 
+    // Left brother is flushed before its children are moved, as its pending elements can belong to them
+    std::pair<result_tag, boost::optional<storage::node_id>> get_left_brother(size_t t, boost::optional<storage::node_id> & tree_root)
+    {
+        assert(!this->parent()->has_pending());
+
+        storage::node_id left_brother = this->parent()->children_[this->child_index() - 1];
+        if (!this->buffer(left_brother)->has_pending())
+            return {result_tag::RESULT, left_brother};
+
+        assert(this->parent_node().size() < 2 * t - 1);
+        auto r = this->buffer_node(left_brother).flush(t, tree_root);
+        if (r)
+            return {result_tag::CONTINUE_FROM, *r };
+
+        return {result_tag::RESULT, this->parent()->children_[this->child_index() - 1]};
+    }
+
     // Ensure this node has enough keys (and children) to safely delete one
     // If it is, return boost::none
     // else steal one child from any brother or merge with brother
@@ -523,7 +632,13 @@ struct b_internal : b_node<Key, Value, Serialized>
         }
         else
         {
-            storage::node_id left_brother = this->parent()->children_[i - 1];
+            std::pair<result_tag, boost::optional<storage::node_id>> changed_subtree = this->get_left_brother(t, tree_root);
+            if (changed_subtree.first == result_tag::CONTINUE_FROM)
+                return changed_subtree.second;
+
+            // Left brother could be split by flush
+            storage::node_id left_brother = *changed_subtree.second;
+            i = this->child_index();
 
             if (this->buffer(left_brother)->keys_.size() >= t)
             {
@@ -545,8 +660,13 @@ struct b_internal : b_node<Key, Value, Serialized>
 
                 this->buffer_node(left_brother).merge_with_right_brother(i - 1, this->id_, t, tree_root);
 
-                // Delete right brother
+                // Delete right brother, the node itself
                 this->storage_.delete_node(this->id_);
+
+                auto parent = this->storage_[left_brother]->parent_;
+                if (!parent)
+                    return left_brother;
+                return parent;
             }
         }
 
@@ -557,10 +677,11 @@ struct b_internal : b_node<Key, Value, Serialized>
     }
 
     virtual std::vector<std::pair<Key, Value>>
-        remove_left_leaf(std::size_t t, boost::optional<storage::node_id> & tree_root)
+        remove_leaf(bool left, std::size_t t, boost::optional<storage::node_id> & tree_root)
     {
-        return node_constructor(*this->storage_[cached_this().children_.front()], this->storage_)
-                -> remove_left_leaf(t, tree_root);
+        storage::node_id child = left ? cached_this().children_.front() : cached_this().children_.back();
+        return node_constructor(*this->storage_[child], this->storage_)
+                -> remove_leaf(left, t, tree_root);
     }
 };
 
@@ -610,15 +731,35 @@ struct b_buffer : b_internal<Key, Value, Serialized>
     // Try to add all elements from pending list to the tree
     // If it can be done without changing the higher-level tree structure, do it and return boost::none
     // else change tree structure and return root of the changed tree
+    // Tombstones are emptied first: every pending add of their pairs is newer
+    // than them, as older adds are cancelled when tombstones get to the buffer
     boost::optional<storage::node_id> flush(size_t t, boost::optional<storage::node_id> & tree_root)
     {
+        HEAP_PROBE(flush);
+        HEAP_PROBE_SIZE(flush, pending_size());
+        while (!cached_this().pending_erase_.empty())
+        {
+            auto x = std::move(cached_this().pending_erase_.front());
+            cached_this().pending_erase_.pop();
+            b_internal<Key, Value, Serialized>::erase(std::move(x.first), std::move(x.second));
+        }
+
         while (!cached_this().pending_add_.empty())
         {
             auto x = std::move(cached_this().pending_add_.front());
             cached_this().pending_add_.pop();
-            boost::optional<storage::node_id> r = b_internal<Key, Value, Serialized>::add(std::move(x.first), std::move(x.second), t, tree_root);
+            boost::optional<storage::node_id> r = b_internal<Key, Value, Serialized>::add(Key(x.first), Value(x.second), t, tree_root);
             if (r)
             {
+                // Element is moved above buffers where newer tombstones can wait
+                for (boost::optional<storage::node_id> y = cached_this().parent_; y; y = this->storage_[*y]->parent_)
+                {
+                    if (this->buffer(*y)->cancel_erase(x))
+                        return r;
+                    if (*y == *r)
+                        break;
+                }
+
                 this->buffer(*r)->pending_add_.push(x);
                 return r;
             }
@@ -639,37 +780,29 @@ struct b_buffer : b_internal<Key, Value, Serialized>
 
         assert(cached_this().parent_ == r.second);
 
-        std::queue<std::pair<Key, Value>> keep_pending;
-        while (!cached_this().pending_add_.empty())
+        // Pending elements are routed by the parent's separators as adds are,
+        // so every tombstone stays with the elements it can cancel
+        auto parent = this->parent_node();
+        std::size_t i = this->child_index();
+        for (bool tombstones : { true, false })
         {
-            auto x = cached_this().pending_add_.front();
-            cached_this().pending_add_.pop();
-
-            std::size_t i = this->child_index();
-            Key left = std::numeric_limits<Key>::min(),
-                right = std::numeric_limits<Key>::max();
-            if (i > 0)
-                left = this->parent()->keys_[i - 1];
-            if (i < this->parent()->keys_.size())
-                right = this->parent()->keys_[i];
-
-            std::pair<Key, Key> range(left, right);
-            if (x.first < range.first)
-            {
-                // push x to left brother
-                this->buffer(this->parent()->children_[i - 1])
-                        ->pending_add_.push(std::move(x));
-            }
-            else if (x.first < range.second)
-                keep_pending.push(std::move(x));
-            else
+            auto & pending = tombstones ? cached_this().pending_erase_ : cached_this().pending_add_;
+            std::queue<std::pair<Key, Value>> keep;
+            while (!pending.empty())
             {
-                // push x to right brother
-                this->buffer(this->parent()->children_[i + 1])
-                        ->pending_add_.push(std::move(x));
+                auto x = std::move(pending.front());
+                pending.pop();
+
+                std::size_t j = parent.child_for(x);
+                if (j == i)
+                    keep.push(std::move(x));
+                else if (!tombstones)
+                    this->buffer(this->parent()->children_[j])->pending_add_.push(std::move(x));
+                else if (!this->buffer(this->parent()->children_[j])->cancel_add(x))
+                    this->buffer(this->parent()->children_[j])->pending_erase_.push(std::move(x));
             }
+            pending.swap(keep);
         }
-        cached_this().pending_add_.swap(keep_pending);
 
         assert(static_cast<bool>(cached_this().parent_));
         return { result_tag::RESULT, *(cached_this().parent_) };
@@ -677,7 +810,7 @@ struct b_buffer : b_internal<Key, Value, Serialized>
 
     virtual boost::optional<storage::node_id> add(Key && key, Value && value, size_t t, boost::optional<storage::node_id> & tree_root)
     {
-        if (cached_this().pending_add_.size() >= t)
+        if (pending_size() >= t)
         {
             boost::optional<storage::node_id> r = this->flush(t, tree_root);
             if (r)
@@ -688,16 +821,36 @@ struct b_buffer : b_internal<Key, Value, Serialized>
         return boost::none;
     }
 
+    virtual void erase(Key && key, Value && value)
+    {
+        auto x = std::make_pair(std::move(key), std::move(value));
+        if (!cached_this().cancel_add(x))
+            cached_this().pending_erase_.push(std::move(x));
+    }
+
+    // Cancel pending add of pair(key, value) or send its tombstone to children
+    // without keeping it in the buffer
+    void erase_unbuffered(Key && key, Value && value)
+    {
+        if (!cached_this().cancel_add(std::make_pair(key, value)))
+            b_internal<Key, Value, Serialized>::erase(std::move(key), std::move(value));
+    }
+
+    std::size_t pending_size() const
+    {
+        return cached_this().pending_add_.size() + cached_this().pending_erase_.size();
+    }
+
     virtual std::vector<std::pair<Key, Value>>
-        remove_left_leaf(std::size_t t, boost::optional<storage::node_id> & tree_root)
+        remove_leaf(bool left, std::size_t t, boost::optional<storage::node_id> & tree_root)
     {
-        if (cached_this().pending_add_.empty())
-            return b_internal<Key, Value, Serialized>::remove_left_leaf(t, tree_root);
+        if (!cached_this().has_pending())
+            return b_internal<Key, Value, Serialized>::remove_leaf(left, t, tree_root);
 
         boost::optional<storage::node_id> r = this->flush(t, tree_root);
         if (r)
-            return this->buffer_node(*r).remove_left_leaf(t, tree_root);
-        return b_internal<Key, Value, Serialized>::remove_left_leaf(t, tree_root);
+            return this->buffer_node(*r).remove_leaf(left, t, tree_root);
+        return b_internal<Key, Value, Serialized>::remove_leaf(left, t, tree_root);
     }
 };
 
@@ -724,17 +877,23 @@ struct b_tree
     using data = detail::b_node_data<Key, Value>;
     using serializer_t = std::function<Serialized *(data *)>;
     using deserializer_t = std::function<data *(Serialized *)>;
+    // Runs all tasks and returns when all of them are finished
+    using executor_t = std::function<void(std::vector<std::function<void()>> &)>;
 
     b_tree(storage::basic_storage<Serialized> & storage,
            std::size_t t,
            boost::optional<storage::node_id> root = boost::none,
            serializer_t serializer = bptree::serialize,
-           deserializer_t deserializer = bptree::deserialize)
+           deserializer_t deserializer = bptree::deserialize,
+           std::size_t cache_limit = 3)
         : nodes_(storage,
                  deserializer,
-                 serializer)
+                 serializer,
+                 cache_limit)
         , t_(t)
         , root_(root)
+        , root_buffer_size_(0)
+        , top_level_(0)
     {}
 
     boost::optional<storage::node_id> root_id() const
@@ -744,31 +903,112 @@ struct b_tree
 
     b_tree(const b_tree & other) = delete;
 
+    // Levels, fanout and buffer occupancy, nodes are read through the cache
+    tree_shape shape()
+    {
+        std::unique_lock<std::shared_timed_mutex> structure(structure_latch_);
+        return bptree::inspect<Key, Value>(root_, [this] (storage::node_id id) { return nodes_[id]; });
+    }
+
+    // Let root buffer grow up to root_buffer_size elements and empty it
+    // with executor, processing share of each child of the root in a separate task
+    void set_flush_executor(executor_t executor, std::size_t root_buffer_size)
+    {
+        std::unique_lock<std::shared_timed_mutex> structure(structure_latch_);
+        executor_ = executor;
+        root_buffer_size_ = root_buffer_size;
+    }
+
+    // Keep up to nodes tree nodes in the cache, besides resident ones
+    void set_cache_limit(std::size_t nodes)
+    {
+        std::unique_lock<std::shared_timed_mutex> structure(structure_latch_);
+        nodes_.set_limit(nodes);
+    }
+
+    // Keep nodes of the upper levels levels of the tree in a separate cache budget
+    // of budget nodes, so descents from the root miss only on the lower levels
+    void set_resident_levels(std::size_t levels, std::size_t budget)
+    {
+        std::unique_lock<std::shared_timed_mutex> structure(structure_latch_);
+        nodes_.set_resident([this, levels] (detail::b_node_data<Key, Value> * node)
+        {
+            return node->level_ + levels > top_level_;
+        }, budget);
+    }
+
     void flush_cache()
     {
+        std::unique_lock<std::shared_timed_mutex> structure(structure_latch_);
         nodes_.flush();
     }
 
     void add(Key key, Value value)
     {
-        b_node_ptr root = load_root();
+        std::unique_lock<std::shared_timed_mutex> structure(structure_latch_);
+        add_exclusive(std::move(key), std::move(value));
+    }
 
-        boost::optional<storage::node_id> r(root->id_);
-        do
+    // Thread-safe version of add
+    // Adds to different children of the root are done in parallel, each thread
+    // holds the latch of the subtree it works in. If the subtree root has to be split,
+    // the element is added again with the whole tree latched.
+    void concurrent_add(Key key, Value value)
+    {
         {
-            // TODO: fix double move
-            r = detail::node_constructor(*nodes_[*r], nodes_)
-                    ->add(std::move(key), std::move(value), t_, root_);
+            std::shared_lock<std::shared_timed_mutex> structure(structure_latch_);
+            typename cache_t::eviction_guard guard(nodes_);
+
+            if (root_)
+            {
+                // Elements can't pass tombstones kept in the root
+                auto root = std::dynamic_pointer_cast<detail::b_buffer_data<Key, Value>>(nodes_[*root_]);
+                if (root && root->pending_erase_.empty())
+                {
+                    auto it = std::lower_bound(root->keys_.begin(), root->keys_.end(), std::make_pair(key, value));
+                    storage::node_id child = root->children_[it - root->keys_.begin()];
+
+                    std::lock_guard<std::mutex> latch(subtree_latch(child));
+                    boost::optional<storage::node_id> subtree_root(child);
+                    auto r = detail::node_constructor(*nodes_[child], nodes_)
+                            ->add(Key(key), Value(value), t_, subtree_root);
+                    if (!r)
+                        return;
+                }
+            }
         }
-        while (r);
+
+        add(std::move(key), std::move(value));
+    }
+
+    // Remove pair(key, value) added earlier, pairs of elements in the tree should be distinct
+    // Removal is buffered as a tombstone and cancels the pending add of the pair
+    // when it gets to the same buffer, so removed elements are not carried to the leaves
+    void erase(Key key, Value value)
+    {
+        std::unique_lock<std::shared_timed_mutex> structure(structure_latch_);
+        erase_exclusive(std::move(key), std::move(value));
     }
 
     template <typename OutIter>
     OutIter remove_left_leaf(OutIter out)
     {
-        b_node_ptr node = load_root();
+        std::unique_lock<std::shared_timed_mutex> structure(structure_latch_);
+        for (auto x : remove_leaf_exclusive(true))
+        {
+            *out = std::move(x);
+            ++out;
+        }
+
+        return out;
+    }
 
-        for (auto x : detail::node_constructor(*node, nodes_)->remove_left_leaf(t_, root_))
+    // Remove leaf with maximal elements, elements are written in ascending order
+    template <typename OutIter>
+    OutIter remove_right_leaf(OutIter out)
+    {
+        std::unique_lock<std::shared_timed_mutex> structure(structure_latch_);
+        for (auto x : remove_leaf_exclusive(false))
         {
             *out = std::move(x);
             ++out;
@@ -779,12 +1019,155 @@ struct b_tree
 
     bool empty()
     {
-        if (!root_)
-            return true;
+        std::unique_lock<std::shared_timed_mutex> structure(structure_latch_);
+        return empty_exclusive();
+    }
 
-        b_node_ptr root = load_root();
-        bool res = detail::node_constructor(*root, nodes_)->size() == 0;
-        return res;
+    // Build empty tree from n elements that next() returns in ascending order
+    // Every node is written once, bottom-up: elements and children are distributed evenly
+    // between nodes of each level (leaves get up to 2 * t - 2 elements, inner nodes up to 2 * t
+    // children), and ids of inner nodes are allocated before their children are built
+    void bulk_load(std::size_t n, std::function<std::pair<Key, Value>()> next)
+    {
+        std::unique_lock<std::shared_timed_mutex> structure(structure_latch_);
+        if (!empty_exclusive())
+            throw std::logic_error("Trying to bulk load non-empty tree");
+        if (root_)
+            nodes_.delete_node(*root_);
+        root_ = boost::none;
+        if (n == 0)
+            return;
+
+        // Number of nodes on each level, the last one is the root
+        std::vector<std::size_t> counts{ (n + 2 * t_ - 3) / (2 * t_ - 2) };
+        while (counts.back() > 1)
+            counts.push_back((counts.back() + 2 * t_ - 1) / (2 * t_));
+        std::size_t height = counts.size() - 1;
+
+        auto quota = [&counts, n] (std::size_t level, std::size_t index)
+        {
+            std::size_t items = level == 0 ? n : counts[level - 1];
+            return items / counts[level] + (index < items % counts[level] ? 1 : 0);
+        };
+
+        std::vector<bulk_node> open(counts.size());
+        for (std::size_t level = height; level > 0; --level)
+            open[level].id = nodes_.new_id();
+
+        // Identical elements are put to one leaf, so a leaf can take elements of the next ones
+        // and the last leaves can be empty
+        std::size_t taken = 0;
+        bool has_peeked = false;
+        std::pair<Key, Value> peeked;
+        boost::optional<std::pair<Key, Value>> previous;
+        auto take = [&taken, &has_peeked, &peeked, &next] ()
+        {
+            ++taken;
+            if (!has_peeked)
+                return next();
+            has_peeked = false;
+            return std::move(peeked);
+        };
+
+        for (std::size_t leaf = 0; leaf < counts[0]; ++leaf)
+        {
+            std::vector<std::pair<Key, Value>> values;
+            for (std::size_t i = std::min(quota(0, leaf), n - taken); i > 0; --i)
+                values.push_back(take());
+            while (!values.empty() && taken < n)
+            {
+                if (!has_peeked)
+                {
+                    peeked = next();
+                    has_peeked = true;
+                }
+                if (!(peeked == values.back()))
+                    break;
+                values.push_back(take());
+            }
+
+            boost::optional<storage::node_id> parent;
+            if (height > 0)
+                parent = open[1].id;
+            // Separator between this leaf and the previous one
+            std::pair<Key, Value> first = values.empty() ? *previous : values.front();
+            if (previous && !values.empty())
+                first = detail::separator(*previous, first);
+            if (!values.empty())
+                previous = values.back();
+            storage::node_id id = nodes_.new_node([&parent, &values] (storage::node_id id)
+            {
+                return new detail::b_leaf_data<Key, Value>(id, parent, 0, values);
+            })->id_;
+
+            if (height == 0)
+                root_ = id;
+            else
+                bulk_attach(open, 1, id, first, counts, quota);
+        }
+    }
+
+    // Move all elements of other tree to this tree
+    // If all elements of one tree are less than all elements of the other one, subtrees
+    // of the lower tree are grafted into the higher tree, else leaves of the smaller tree
+    // (by height, then by number of children of the root) are removed one by one and
+    // their elements are added to the buffers of the larger one.
+    // If the trees are kept in different storages, every node of the other tree
+    // (or of the drained this tree, when the other one is larger) is copied to
+    // this tree's storage, which costs a load and a write per node
+    void meld(b_tree & other)
+    {
+        std::unique_lock<std::shared_timed_mutex> structure(structure_latch_, std::defer_lock);
+        std::unique_lock<std::shared_timed_mutex> other_structure(other.structure_latch_, std::defer_lock);
+        std::lock(structure, other_structure);
+
+        if (other.empty_exclusive())
+            return;
+
+        if (empty_exclusive())
+        {
+            if (root_)
+                nodes_.delete_node(*root_);
+            root_ = transfer(other);
+            return;
+        }
+
+        auto range = key_range();
+        auto other_range = other.key_range();
+        // Identical elements can't be on both sides of a separator
+        bool other_right = range.second && other_range.first && *range.second < *other_range.first;
+        bool other_left = other_range.second && range.first && *other_range.second < *range.first;
+        if (!other_right && !other_left)
+        {
+            b_tree * larger = this, * smaller = &other;
+            if (size_estimate() < other.size_estimate())
+                std::swap(larger, smaller);
+
+            while (!smaller->empty_exclusive())
+                for (auto x : smaller->remove_leaf_exclusive(true))
+                    larger->add_exclusive(std::move(x.first), std::move(x.second));
+
+            if (larger == &other)
+            {
+                if (root_)
+                    nodes_.delete_node(*root_);
+                root_ = transfer(other);
+            }
+            return;
+        }
+
+        storage::node_id other_root = transfer(other);
+        storage::node_id grafted = other_root;
+        if (nodes_[other_root]->level_ > nodes_[*root_]->level_)
+        {
+            // Graft this tree into the higher one
+            std::swap(other_range, range);
+            other_left = !other_left;
+            grafted = *root_;
+            root_ = other_root;
+        }
+
+        graft(grafted, other_left, other_left ? *other_range.second : *range.second);
     }
 
 private:
@@ -798,6 +1181,344 @@ private:
     std::size_t t_;
     boost::optional<storage::node_id> root_;
 
+    // Latches of subtrees are striped by node id
+    static constexpr std::size_t latches_count = 64;
+    std::shared_timed_mutex structure_latch_;
+    std::array<std::mutex, latches_count> subtree_latches_;
+
+    std::mutex & subtree_latch(const storage::node_id & id)
+    {
+        return subtree_latches_[id % latches_count];
+    }
+
+    executor_t executor_;
+    std::size_t root_buffer_size_;
+    // Level of the root when it was loaded last time
+    std::atomic<std::uint64_t> top_level_;
+
+    void add_exclusive(Key key, Value value)
+    {
+        b_node_ptr root = load_root();
+
+        if (executor_)
+        {
+            auto root_buffer = std::dynamic_pointer_cast<detail::b_buffer_data<Key, Value>>(root);
+            if (root_buffer && root_buffer->pending_erase_.empty())
+            {
+                root_buffer->pending_add_.push(std::make_pair(std::move(key), std::move(value)));
+                if (root_buffer->pending_add_.size() >= root_buffer_size_)
+                    parallel_flush(root_buffer);
+                return;
+            }
+        }
+
+        add_from(root, std::move(key), std::move(value));
+    }
+
+    void add_from(b_node_ptr root, Key key, Value value)
+    {
+        boost::optional<storage::node_id> r(root->id_);
+        do
+        {
+            // TODO: fix double move
+            r = detail::node_constructor(*nodes_[*r], nodes_)
+                    ->add(std::move(key), std::move(value), t_, root_);
+        }
+        while (r);
+    }
+
+    void erase_exclusive(Key key, Value value)
+    {
+        b_node_ptr root = load_root();
+
+        // Root buffer emptied by parallel flush keeps only adds
+        auto root_buffer = std::dynamic_pointer_cast<detail::b_buffer_data<Key, Value>>(root);
+        if (executor_ && root_buffer)
+            detail::b_buffer<Key, Value, Serialized>(*root_buffer, nodes_)
+                    .erase_unbuffered(std::move(key), std::move(value));
+        else
+            detail::node_constructor(*root, nodes_)->erase(std::move(key), std::move(value));
+    }
+
+    // Empty root buffer: elements are partitioned by root keys and each child's share
+    // is added to its subtree in a separate task. Task stops when the child itself
+    // has to be split, rest of its share is added after all tasks are joined.
+    void parallel_flush(std::shared_ptr<detail::b_buffer_data<Key, Value>> root)
+    {
+        std::vector<std::queue<std::pair<Key, Value>>> shares(root->children_.size());
+        while (!root->pending_add_.empty())
+        {
+            auto x = std::move(root->pending_add_.front());
+            root->pending_add_.pop();
+            auto it = std::lower_bound(root->keys_.begin(), root->keys_.end(), x);
+            shares[it - root->keys_.begin()].push(std::move(x));
+        }
+
+        {
+            // Every task pins nodes it gets from the cache on its own thread
+            std::vector<std::function<void()>> tasks;
+            for (std::size_t i = 0; i < shares.size(); ++i)
+            {
+                if (shares[i].empty())
+                    continue;
+
+                storage::node_id child = root->children_[i];
+                auto & share = shares[i];
+                tasks.push_back([this, child, &share] ()
+                {
+                    typename cache_t::eviction_guard guard(nodes_);
+                    boost::optional<storage::node_id> subtree_root(child);
+                    while (!share.empty())
+                    {
+                        auto & x = share.front();
+                        auto r = detail::node_constructor(*nodes_[child], nodes_)
+                                ->add(Key(x.first), Value(x.second), t_, subtree_root);
+                        if (r)
+                            return;
+                        share.pop();
+                    }
+                });
+            }
+            executor_(tasks);
+        }
+
+        // Children that should be split are handled by usual add
+        for (auto & share : shares)
+            while (!share.empty())
+            {
+                add_from(load_root(), std::move(share.front().first), std::move(share.front().second));
+                share.pop();
+            }
+    }
+
+    // Inner node that is being built by bulk_load
+    struct bulk_node
+    {
+        storage::node_id id;
+        std::size_t index = 0;
+        std::vector<std::pair<Key, Value>> keys;
+        std::vector<storage::node_id> children;
+        // Separator before the first child
+        std::pair<Key, Value> first;
+    };
+
+    // Add child to the node built on the level, write the node when it gets all its children
+    template <typename Quota>
+    void bulk_attach(std::vector<bulk_node> & open, std::size_t level, storage::node_id child, const std::pair<Key, Value> & first,
+                     const std::vector<std::size_t> & counts, Quota quota)
+    {
+        bulk_node & node = open[level];
+        if (node.children.empty())
+            node.first = first;
+        else
+            node.keys.push_back(first);
+        node.children.push_back(child);
+        if (node.children.size() < quota(level, node.index))
+            return;
+
+        boost::optional<storage::node_id> parent;
+        if (level + 1 < open.size())
+            parent = open[level + 1].id;
+        nodes_.new_node(node.id, new detail::b_buffer_data<Key, Value>(
+                            node.id, parent, level, node.keys, node.children, {}));
+
+        if (!parent)
+            root_ = node.id;
+        else
+            bulk_attach(open, level + 1, node.id, node.first, counts, quota);
+
+        if (++node.index < counts[level])
+        {
+            node.id = nodes_.new_id();
+            node.keys.clear();
+            node.children.clear();
+        }
+    }
+
+    std::vector<std::pair<Key, Value>> remove_leaf_exclusive(bool left)
+    {
+        b_node_ptr node = load_root();
+        return detail::node_constructor(*node, nodes_)->remove_leaf(left, t_, root_);
+    }
+
+    bool empty_exclusive()
+    {
+        if (!root_)
+            return true;
+
+        b_node_ptr root = load_root();
+        bool res = detail::node_constructor(*root, nodes_)->size() == 0;
+        return res;
+    }
+
+    // Height and number of children of the root, to compare sizes of trees
+    std::pair<std::size_t, std::size_t> size_estimate()
+    {
+        b_node_ptr root = load_root();
+        if (auto buffer = std::dynamic_pointer_cast<detail::b_buffer_data<Key, Value>>(root))
+            return { buffer->level_, buffer->children_.size() };
+        return { 0, std::dynamic_pointer_cast<detail::b_leaf_data<Key, Value>>(root)->values_.size() };
+    }
+
+    // Minimal and maximal elements in non-empty tree
+    // Only leftmost and rightmost paths from the root are read
+    std::pair<boost::optional<std::pair<Key, Value>>, boost::optional<std::pair<Key, Value>>> key_range()
+    {
+        std::pair<boost::optional<std::pair<Key, Value>>, boost::optional<std::pair<Key, Value>>> range;
+        for (bool left : { true, false })
+        {
+            boost::optional<std::pair<Key, Value>> & bound = left ? range.first : range.second;
+            auto extend = [&bound, left] (const std::pair<Key, Value> & x)
+            {
+                if (left ? x < *bound : *bound < x)
+                    bound = x;
+            };
+
+            std::vector<std::shared_ptr<detail::b_buffer_data<Key, Value>>> path;
+            storage::node_id x = *root_;
+            while (auto buffer = std::dynamic_pointer_cast<detail::b_buffer_data<Key, Value>>(nodes_[x]))
+            {
+                path.push_back(buffer);
+                x = left ? buffer->children_.front() : buffer->children_.back();
+            }
+
+            // Other leaves can hold keys beyond the boundary of an empty leaf, the bound is unknown then
+            auto leaf = std::dynamic_pointer_cast<detail::b_leaf_data<Key, Value>>(nodes_[x]);
+            if (leaf->values_.empty())
+                continue;
+            bound = left ? leaf->values_.front() : leaf->values_.back();
+            for (auto & buffer : path)
+                for (auto pending = buffer->pending_add_; !pending.empty(); pending.pop())
+                    extend(pending.front());
+        }
+
+        return range;
+    }
+
+    // Move all nodes of other tree to this tree's storage and return its root
+    // If both trees use the same storage, nodes are just forgotten by other tree's cache
+    storage::node_id transfer(b_tree & other)
+    {
+        storage::node_id root = *other.root_;
+        if (&other.nodes_.backing_storage() == &nodes_.backing_storage())
+        {
+            other.nodes_.flush();
+            other.nodes_.clear();
+        }
+        else
+            root = copy_subtree(other, root, boost::none);
+
+        other.root_ = boost::none;
+        return root;
+    }
+
+    storage::node_id copy_subtree(b_tree & other, storage::node_id id, boost::optional<storage::node_id> parent)
+    {
+        std::shared_ptr<detail::b_node_data<Key, Value>> node(other.nodes_[id]->copy_data());
+        other.nodes_.delete_node(id);
+        std::vector<storage::node_id> children;
+        if (auto buffer = std::dynamic_pointer_cast<detail::b_buffer_data<Key, Value>>(node))
+            children.swap(buffer->children_);
+
+        storage::node_id copy = nodes_.new_node([&node, &parent] (storage::node_id id)
+        {
+            auto x = node->copy_data();
+            x->id_ = id;
+            x->parent_ = parent;
+            return x;
+        })->id_;
+
+        if (children.empty())
+            return copy;
+
+        for (auto & child : children)
+            child = copy_subtree(other, child, copy);
+        std::dynamic_pointer_cast<detail::b_buffer_data<Key, Value>>(nodes_[copy])->children_.swap(children);
+        return copy;
+    }
+
+    // Graft subtree of lower tree into this tree to the left or to the right of all its nodes
+    // Subtree root is grafted as is only if it is lower than this tree's root and has enough keys
+    // to be a non-root node, else its children are grafted one by one
+    // Separator is the maximal element of the subtree when grafting to the left,
+    // the maximal element of this tree else
+    void graft(storage::node_id subtree, bool left, const std::pair<Key, Value> & separator)
+    {
+        auto node = detail::node_constructor(*nodes_[subtree], nodes_);
+        if (nodes_[subtree]->level_ < nodes_[*root_]->level_ && node->size() >= t_ - 1)
+        {
+            graft_node(subtree, left, separator);
+            return;
+        }
+
+        auto leaf = std::dynamic_pointer_cast<detail::b_leaf_data<Key, Value>>(nodes_[subtree]);
+        if (leaf)
+        {
+            auto values = leaf->values_;
+            nodes_.delete_node(subtree);
+            for (auto & x : values)
+                add_from(load_root(), std::move(x.first), std::move(x.second));
+            return;
+        }
+
+        auto buffer = std::dynamic_pointer_cast<detail::b_buffer_data<Key, Value>>(nodes_[subtree]);
+        std::vector<std::pair<Key, Value>> keys = buffer->keys_;
+        std::vector<storage::node_id> children = buffer->children_;
+        std::queue<std::pair<Key, Value>> pending = buffer->pending_add_;
+        std::queue<std::pair<Key, Value>> erased = buffer->pending_erase_;
+        buffer.reset();
+        nodes_.delete_node(subtree);
+
+        // Separator of i-th child: the one before it when grafting to the right,
+        // the one after it when grafting to the left
+        keys.insert(left ? keys.end() : keys.begin(), separator);
+        for (std::size_t j = 0; j < children.size(); ++j)
+        {
+            std::size_t i = left ? children.size() - j - 1 : j;
+            graft_node(children[i], left, keys[i]);
+        }
+
+        // Tombstones are older than pending adds of the node
+        for (; !erased.empty(); erased.pop())
+            erase_exclusive(std::move(erased.front().first), std::move(erased.front().second));
+        for (; !pending.empty(); pending.pop())
+            add_from(load_root(), std::move(pending.front().first), std::move(pending.front().second));
+    }
+
+    // Make node the leftmost or the rightmost child of the node one level above it,
+    // splitting nodes on the way from the root when they are full
+    void graft_node(storage::node_id subtree, bool left, const std::pair<Key, Value> & separator)
+    {
+        std::size_t level = nodes_[subtree]->level_;
+        storage::node_id x = *root_;
+        while (true)
+        {
+            if (detail::node_constructor(*nodes_[x], nodes_)->ensure_not_too_big(t_, root_))
+            {
+                x = *root_;
+                continue;
+            }
+
+            auto buffer = std::dynamic_pointer_cast<detail::b_buffer_data<Key, Value>>(nodes_[x]);
+            if (buffer->level_ == level + 1)
+                break;
+            x = left ? buffer->children_.front() : buffer->children_.back();
+        }
+
+        auto buffer = std::dynamic_pointer_cast<detail::b_buffer_data<Key, Value>>(nodes_[x]);
+        if (left)
+        {
+            buffer->keys_.insert(buffer->keys_.begin(), separator);
+            buffer->children_.insert(buffer->children_.begin(), subtree);
+        }
+        else
+        {
+            buffer->keys_.push_back(separator);
+            buffer->children_.push_back(subtree);
+        }
+        nodes_[subtree]->parent_ = x;
+    }
+
     using leaf_t = detail::b_leaf<Key, Value, Serialized>;
     using internal_t = detail::b_internal<Key, Value, Serialized>;
 
@@ -813,10 +1534,13 @@ private:
         {
             b_node_ptr root = nodes_.new_node([] (storage::node_id id) { return new detail::b_leaf_data<Key, Value>(id); });
             root_ = root->id_;
+            top_level_ = 0;
             return root;
         }
 
-        return nodes_[*root_];
+        b_node_ptr root = nodes_[*root_];
+        top_level_ = root->level_;
+        return root;
     }
 };
 }
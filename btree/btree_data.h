@@ -57,7 +57,9 @@ struct b_leaf_data : b_node_data<Key, Value>
 template <typename Key, typename Value>
 struct b_internal_data : b_node_data<Key, Value>
 {
-    std::vector<Key> keys_;
+    // Separators are pairs, so identical keys with different values can be told apart:
+    // i-th child holds elements greater than keys_[i - 1] and not greater than keys_[i]
+    std::vector<std::pair<Key, Value>> keys_;
     std::vector<storage::node_id> children_;
 
     b_internal_data(const storage::node_id & id,
@@ -69,7 +71,7 @@ struct b_internal_data : b_node_data<Key, Value>
     b_internal_data(const storage::node_id & id,
                     const boost::optional<storage::node_id> & parent,
                     std::size_t level,
-                    const std::vector<Key> & keys,
+                    const std::vector<std::pair<Key, Value>> & keys,
                     const std::vector<storage::node_id> & children)
         : b_node_data<Key, Value>(id, parent, level)
         , keys_(keys)
@@ -83,6 +85,8 @@ template <typename Key, typename Value>
 struct b_buffer_data : b_internal_data<Key, Value>
 {
     std::queue<std::pair<Key, Value> > pending_add_;
+    // Tombstones of elements added earlier, they are emptied before pending adds
+    std::queue<std::pair<Key, Value> > pending_erase_;
 
     b_buffer_data(const storage::node_id & id,
                   std::size_t level)
@@ -92,18 +96,53 @@ struct b_buffer_data : b_internal_data<Key, Value>
     b_buffer_data(const storage::node_id & id,
                   const boost::optional<storage::node_id> & parent,
                   std::size_t level,
-                  const std::vector<Key> & keys,
+                  const std::vector<std::pair<Key, Value>> & keys,
                   const std::vector<storage::node_id> & children,
-                  const std::queue<std::pair<Key, Value>> & pending)
+                  const std::queue<std::pair<Key, Value>> & pending,
+                  const std::queue<std::pair<Key, Value>> & erased = {})
         : b_internal_data<Key, Value>(id, parent, level, keys, children)
         , pending_add_(pending)
+        , pending_erase_(erased)
     {}
 
     b_buffer_data() {}
 
+    bool has_pending() const
+    {
+        return !pending_add_.empty() || !pending_erase_.empty();
+    }
+
+    // Remove pending add of x from the buffer, return false if there is none
+    bool cancel_add(const std::pair<Key, Value> & x)
+    {
+        return remove_one(pending_add_, x);
+    }
+
+    bool cancel_erase(const std::pair<Key, Value> & x)
+    {
+        return remove_one(pending_erase_, x);
+    }
+
     virtual b_buffer_data * copy_data() const
     {
         return new b_buffer_data(*this);
     }
+
+private:
+    static bool remove_one(std::queue<std::pair<Key, Value>> & pending, const std::pair<Key, Value> & x)
+    {
+        bool found = false;
+        for (std::size_t n = pending.size(); n > 0; --n)
+        {
+            auto y = std::move(pending.front());
+            pending.pop();
+            if (!found && y == x)
+                found = true;
+            else
+                pending.push(std::move(y));
+        }
+
+        return found;
+    }
 };
 }
@@ -1,12 +1,21 @@
 #include "btree.h"
+#include "slotted_page.h"
 
 #include <storage/memory.h>
 #include <storage/directory.h>
+#include <storage/counting.h>
+#include <storage/heat_map.h>
+#include <storage/device.h>
+#include <utils/thread_pool.h>
 
 #include <gtest/gtest.h>
 #include <iterator>
 #include <iostream>
+#include <sstream>
 #include <functional>
+#include <random>
+#include <thread>
+#include <set>
 
 template <typename K, typename V, typename Serialized>
 std::vector<std::pair<K, V>> from_tree(bptree::b_tree<K, V, Serialized> & tree)
@@ -141,6 +150,607 @@ TEST(btree, independent)
         EXPECT_EQ(std::find(v2.begin(), v2.end(), x), v2.end());
 }
 
+TEST(btree, concurrent)
+{
+    storage::memory<std::string> mem;
+    bptree::b_tree<std::uint64_t, std::uint64_t> tree(mem, 4);
+
+    std::size_t threads_count = 8, size = 2000;
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < threads_count; ++i)
+        threads.emplace_back([&tree, i, size] ()
+        {
+            std::default_random_engine generator(i);
+            std::uniform_int_distribution<std::uint64_t> distribution(1, 1000000);
+            for (std::size_t j = 0; j < size; ++j)
+            {
+                auto x = distribution(generator);
+                tree.concurrent_add(x, x);
+            }
+        });
+    for (auto & thread : threads)
+        thread.join();
+
+    std::vector<std::pair<std::uint64_t, std::uint64_t> > src;
+    for (std::size_t i = 0; i < threads_count; ++i)
+    {
+        std::default_random_engine generator(i);
+        std::uniform_int_distribution<std::uint64_t> distribution(1, 1000000);
+        for (std::size_t j = 0; j < size; ++j)
+        {
+            auto x = distribution(generator);
+            src.push_back({x, x});
+        }
+    }
+    std::sort(src.begin(), src.end());
+
+    std::vector<std::pair<std::uint64_t, std::uint64_t> > v = from_tree(tree);
+    EXPECT_EQ(src, v);
+}
+
+TEST(cache, eviction_guard)
+{
+    using data = detail::b_node_data<std::uint64_t, std::uint64_t>;
+    using leaf = detail::b_leaf_data<std::uint64_t, std::uint64_t>;
+    storage::memory<std::string> mem;
+    storage::counting<std::string> counted(mem);
+    storage::cache<data, std::string> cache(counted, bptree::deserialize, bptree::serialize, 3);
+    auto make = [] (storage::node_id id) -> data *
+    {
+        return new leaf(id, boost::none, 0, { { id, id } });
+    };
+    auto add_nodes = [&cache, &make] ()
+    {
+        std::thread([&cache, &make] ()
+        {
+            for (std::size_t i = 0; i < 10; ++i)
+                cache.new_node(make);
+        }).join();
+    };
+
+    std::shared_ptr<data> pinned;
+    {
+        storage::cache<data, std::string>::eviction_guard guard(cache);
+        pinned = cache.new_node(make);
+        // Nodes of other threads are evicted while the guard is alive, pinned one is not
+        add_nodes();
+        EXPECT_EQ(8u, counted.total().writes);
+        EXPECT_EQ(pinned, cache[pinned->id_]);
+        dynamic_cast<leaf &>(*pinned).values_.push_back({ 0, 0 });
+    }
+
+    add_nodes();
+    EXPECT_EQ(18u, counted.total().writes);
+    auto loaded = cache[pinned->id_];
+    EXPECT_NE(pinned, loaded);
+    EXPECT_EQ(2u, dynamic_cast<leaf &>(*loaded).values_.size());
+}
+
+TEST(cache, set_limit)
+{
+    using data = detail::b_node_data<std::uint64_t, std::uint64_t>;
+    storage::memory<std::string> mem;
+    storage::counting<std::string> counted(mem);
+    storage::cache<data, std::string> cache(counted, bptree::deserialize, bptree::serialize, 10);
+    for (std::size_t i = 0; i < 10; ++i)
+        cache.new_node([] (storage::node_id id) -> data *
+        {
+            return new detail::b_leaf_data<std::uint64_t, std::uint64_t>(id, boost::none, 0, { { id, id } });
+        });
+    EXPECT_EQ(0u, counted.total().writes);
+
+    // Least recently used nodes are written back at once
+    cache.set_limit(4);
+    EXPECT_EQ(6u, counted.total().writes);
+    cache.flush();
+    EXPECT_EQ(10u, counted.total().writes);
+}
+
+TEST(btree, parallel_flush)
+{
+    storage::memory<std::string> mem;
+    bptree::b_tree<std::uint64_t, std::uint64_t> tree(mem, 4);
+    utils::thread_pool pool(4);
+    tree.set_flush_executor([&pool] (std::vector<std::function<void()>> & tasks) { pool.run(tasks); }, 1000);
+
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::uint64_t> distribution(1, 1000000);
+    std::vector<std::pair<std::uint64_t, std::uint64_t> > src;
+    for (std::size_t i = 0; i < 20000; ++i)
+    {
+        auto x = distribution(generator);
+        src.push_back({x, x});
+        tree.add(x, x);
+    }
+    std::sort(src.begin(), src.end());
+
+    std::vector<std::pair<std::uint64_t, std::uint64_t> > v = from_tree(tree);
+    EXPECT_EQ(src, v);
+}
+
+void test_meld(storage::basic_storage<std::string> & mem1, storage::basic_storage<std::string> & mem2,
+               std::size_t size1, std::size_t size2, std::uint64_t offset2)
+{
+    bptree::b_tree<std::uint64_t, std::uint64_t> tree1(mem1, 3), tree2(mem2, 3);
+
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::uint64_t> distribution(1, 100000);
+    std::vector<std::pair<std::uint64_t, std::uint64_t> > src;
+    for (std::size_t i = 0; i < size1; ++i)
+    {
+        auto x = distribution(generator);
+        src.push_back({x, x});
+        tree1.add(x, x);
+    }
+    for (std::size_t i = 0; i < size2; ++i)
+    {
+        auto x = distribution(generator) + offset2;
+        src.push_back({x, x});
+        tree2.add(x, x);
+    }
+    std::sort(src.begin(), src.end());
+
+    tree1.meld(tree2);
+    EXPECT_TRUE(tree2.empty());
+    EXPECT_EQ(src, from_tree(tree1));
+}
+
+TEST(btree, meld)
+{
+    for (auto sizes : std::vector<std::pair<std::size_t, std::size_t>>{ {1000, 10}, {10, 1000}, {1000, 1000}, {0, 100}, {2, 3} })
+    {
+        {
+            // Disjoint ranges, different storages
+            storage::memory<std::string> mem1, mem2;
+            test_meld(mem1, mem2, sizes.first, sizes.second, 100000);
+        }
+        {
+            // Disjoint ranges, tree to the left
+            storage::memory<std::string> mem1, mem2;
+            test_meld(mem2, mem1, sizes.second, sizes.first, 100000);
+        }
+        {
+            // Disjoint ranges, same storage
+            storage::memory<std::string> mem;
+            test_meld(mem, mem, sizes.first, sizes.second, 100000);
+        }
+        {
+            // Overlapping ranges
+            storage::memory<std::string> mem1, mem2;
+            test_meld(mem1, mem2, sizes.first, sizes.second, 0);
+        }
+        {
+            // Overlapping ranges, same storage
+            storage::memory<std::string> mem;
+            test_meld(mem, mem, sizes.first, sizes.second, 0);
+        }
+    }
+}
+
+TEST(btree, string_meld)
+{
+    // Keys of the second tree are all greater, so it is grafted whole
+    for (std::string second_prefix : { "b", "a" })
+    {
+        storage::memory<std::string> mem;
+        storage::counting<std::string> counted(mem, bptree::classify);
+        bptree::b_tree<std::string, std::uint64_t> tree1(counted, 4, boost::none, bptree::serialize_slotted, bptree::deserialize_slotted),
+                tree2(counted, 4, boost::none, bptree::serialize_slotted, bptree::deserialize_slotted);
+
+        std::default_random_engine generator;
+        std::vector<std::pair<std::string, std::uint64_t>> src;
+        for (std::uint64_t i = 0; i < 2000; ++i)
+        {
+            src.push_back({ "a" + std::to_string(generator() % 100000), i });
+            tree1.add(src.back().first, src.back().second);
+            src.push_back({ second_prefix + std::to_string(generator() % 100000), i });
+            tree2.add(src.back().first, src.back().second);
+        }
+        tree1.flush_cache();
+        tree2.flush_cache();
+        auto before = counted.total();
+        tree1.meld(tree2);
+        // Grafting reads and writes a few nodes, melding overlapping trees moves every element
+        if (second_prefix == "b")
+        {
+            EXPECT_GT(100u, counted.total().ios() - before.ios());
+        }
+
+        EXPECT_TRUE(tree2.empty());
+        std::sort(src.begin(), src.end());
+        auto v = from_tree(tree1);
+        std::sort(v.begin(), v.end());
+        EXPECT_EQ(src, v);
+    }
+}
+
+TEST(btree, resident_levels)
+{
+    std::size_t loads[2];
+    for (bool resident : { false, true })
+    {
+        storage::memory<std::string> mem;
+        storage::counting<std::string> counted(mem);
+        bptree::b_tree<std::uint64_t, std::uint64_t> tree(counted, 3);
+        if (resident)
+            tree.set_resident_levels(3, 64);
+
+        std::default_random_engine generator;
+        std::uniform_int_distribution<std::uint64_t> distribution(1, 1000000);
+        for (std::size_t i = 0; i < 10000; ++i)
+        {
+            auto x = distribution(generator);
+            tree.add(x, x);
+        }
+
+        counted.reset();
+        std::vector<std::pair<std::uint64_t, std::uint64_t> > v;
+        auto out = std::back_inserter(v);
+        for (std::size_t i = 0; i < 1000; ++i)
+        {
+            auto x = distribution(generator);
+            tree.add(x, x);
+            if (i % 10 == 0)
+                out = tree.remove_left_leaf(out);
+        }
+        loads[resident] = counted.total().loads;
+
+        v = from_tree(tree);
+        EXPECT_TRUE(std::is_sorted(v.begin(), v.end()));
+    }
+
+    EXPECT_LT(loads[true], loads[false]);
+}
+
+TEST(btree, io_counting)
+{
+    storage::memory<std::string> mem;
+    storage::counting<std::string> counted(mem, bptree::classify);
+    const storage::node_kind leaf{ "leaf", 0 };
+    {
+        bptree::b_tree<std::uint64_t, std::uint64_t> tree(counted, 3);
+        std::default_random_engine generator;
+        std::uniform_int_distribution<std::uint64_t> distribution(1, 1000000);
+        for (std::size_t i = 0; i < 10000; ++i)
+        {
+            auto x = distribution(generator);
+            tree.add(x, x);
+        }
+        auto kinds = counted.by_kind();
+        EXPECT_GT(kinds[leaf].writes, 0);
+        // Kinds are ordered by type and level, the last buffer kind is the root level
+        const storage::node_kind root = std::prev(kinds.lower_bound(leaf))->first;
+        EXPECT_EQ("buffer", root.type);
+        EXPECT_GT(root.level, 1);
+        EXPECT_GT(kinds[root].writes, 0);
+
+        counted.reset();
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> v;
+        tree.remove_left_leaf(std::back_inserter(v));
+    }
+
+    // Leaves are loaded and deleted by removal, cached nodes are written by tree destructor
+    auto kinds = counted.by_kind();
+    EXPECT_GT(kinds[leaf].loads, 0);
+    EXPECT_GT(kinds[leaf].deletes, 0);
+    EXPECT_EQ(kinds.end(), std::find_if(kinds.begin(), kinds.end(),
+                                        [] (const std::pair<const storage::node_kind, storage::io_counters> & x)
+                                        { return x.first.type == "other"; }));
+
+    auto total = counted.total();
+    EXPECT_EQ(total.loads + total.writes, total.ios());
+    EXPECT_GT(total.bytes_written, total.writes);
+}
+
+TEST(btree, shape)
+{
+    std::size_t t = 3;
+    storage::memory<std::string> mem;
+    storage::heat_map<std::string> heat(mem, bptree::classify);
+    bptree::b_tree<std::uint64_t, std::uint64_t> tree(heat, t);
+    EXPECT_EQ(0u, tree.shape().depth());
+
+    // Elements are distinct: leaves are not split between identical elements,
+    // so the one next to them can get less than t - 1 elements
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::uint64_t> distribution(1, 1000000);
+    for (std::size_t i = 0; i < 10000; ++i)
+    {
+        auto x = distribution(generator);
+        tree.add(x, i);
+    }
+
+    auto shape = tree.shape();
+    EXPECT_GT(shape.depth(), 2u);
+    EXPECT_EQ(0u, shape.misplaced);
+    EXPECT_EQ(1u, shape.levels.back().nodes);
+    std::size_t pending = 0;
+    for (std::size_t i = 0; i < shape.depth(); ++i)
+    {
+        auto & level = shape.levels[i];
+        EXPECT_GT(level.nodes, 0u);
+        // Nodes except the root have t - 1 to 2t - 1 elements or keys
+        std::size_t low = i + 1 == shape.depth() ? 1 : (i == 0 ? t - 1 : t);
+        EXPECT_LE(low, level.fanout.begin()->first);
+        EXPECT_GE(i == 0 ? 2 * t - 1 : 2 * t, level.fanout.rbegin()->first);
+        // Buffers are flushed when they have t pending elements
+        EXPECT_LE(level.max_pending, t);
+        pending += level.pending_adds;
+        if (i > 0)
+        {
+            std::size_t children = 0;
+            for (auto & f : level.fanout)
+                children += f.first * f.second;
+            EXPECT_EQ(children, shape.levels[i - 1].nodes);
+        }
+    }
+    EXPECT_EQ(10000u, shape.elements + pending);
+
+    // Shape read from the storage is the same as through the cache
+    tree.flush_cache();
+    auto stored = bptree::inspect<std::uint64_t, std::uint64_t, std::string>(mem, tree.root_id(), bptree::deserialize);
+    ASSERT_EQ(shape.depth(), stored.depth());
+    for (std::size_t i = 0; i < shape.depth(); ++i)
+    {
+        EXPECT_EQ(shape.levels[i].fanout, stored.levels[i].fanout);
+        EXPECT_EQ(shape.levels[i].pending_adds, stored.levels[i].pending_adds);
+    }
+    std::ostringstream out;
+    bptree::print(out, stored, t);
+    EXPECT_NE(std::string::npos, out.str().find("Level 0 (leaves)"));
+
+    // Nodes are allocated by splits, the root is the hottest as every add goes through it
+    auto kinds = heat.by_kind();
+    const storage::node_kind leaf{ "leaf", 0 };
+    EXPECT_EQ(shape.levels[0].nodes, kinds[leaf].allocated - kinds[leaf].deleted);
+    EXPECT_EQ(shape.levels[0].nodes, kinds[leaf].nodes - kinds[leaf].deleted);
+    auto hottest = heat.hottest(3);
+    ASSERT_EQ(3u, hottest.size());
+    EXPECT_GE(hottest[0].second.ios.ios(), hottest[1].second.ios.ios());
+    EXPECT_GE(hottest[1].second.ios.ios(), hottest[2].second.ios.ios());
+    EXPECT_EQ("buffer", hottest[0].second.kind.type);
+}
+
+TEST(device, timing)
+{
+    using std::chrono::microseconds;
+    storage::memory<std::string> mem;
+    storage::device_profile profile{ microseconds(1), microseconds(100), 1e9, 1 };
+    storage::device<std::string> device(mem, profile);
+
+    // Node of 1000 bytes takes 1 us of latency and 1 us of transfer
+    std::string node(1000, 'x');
+    for (std::size_t i = 0; i < 10; ++i)
+        device.write_node(device.new_node(), &node);
+    EXPECT_EQ(microseconds(20), device.elapsed());
+
+    device.load_node(5);
+    EXPECT_EQ(microseconds(122), device.elapsed());
+    device.load_node(6);
+    EXPECT_EQ(microseconds(124), device.elapsed());
+    device.delete_node(6);
+    EXPECT_EQ(microseconds(125), device.elapsed());
+
+    device.reset();
+    EXPECT_EQ(microseconds(0), device.elapsed());
+}
+
+TEST(device, queue_depth)
+{
+    std::chrono::nanoseconds elapsed[2];
+    for (std::size_t depth : { 1, 2 })
+    {
+        storage::memory<std::string> mem;
+        storage::device_profile profile{ std::chrono::microseconds(10), std::chrono::nanoseconds(0), 1e9, depth };
+        storage::device<std::string> device(mem, profile);
+        std::string node(1000, 'x');
+        std::vector<std::thread> threads;
+        for (std::size_t i = 0; i < 2; ++i)
+            threads.emplace_back([&device, &node] ()
+            {
+                for (std::size_t j = 0; j < 10; ++j)
+                    device.write_node(device.new_node(), &node);
+            });
+        for (auto & thread : threads)
+            thread.join();
+        elapsed[depth - 1] = device.elapsed();
+    }
+
+    EXPECT_EQ(std::chrono::microseconds(20 * 11), elapsed[0]);
+    EXPECT_LT(elapsed[1], elapsed[0]);
+}
+
+TEST(btree, remove_right_leaf)
+{
+    storage::memory<std::string> mem;
+    bptree::b_tree<std::uint64_t, std::uint64_t> tree(mem, 3);
+
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::uint64_t> distribution(1, 1000);
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> expected;
+    for (std::uint64_t i = 0; i < 5000; ++i)
+    {
+        auto x = distribution(generator);
+        tree.add(x, x);
+        expected.push_back({x, x});
+    }
+    std::sort(expected.begin(), expected.end());
+
+    // Leaves are taken from both ends
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> left, right;
+    for (std::size_t i = 0; !tree.empty(); ++i)
+    {
+        if (i % 3 == 0)
+        {
+            tree.remove_left_leaf(std::back_inserter(left));
+            continue;
+        }
+
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> leaf;
+        tree.remove_right_leaf(std::back_inserter(leaf));
+        EXPECT_TRUE(right.empty() || leaf.empty() || leaf.back() <= right.front());
+        right.insert(right.begin(), leaf.begin(), leaf.end());
+    }
+
+    left.insert(left.end(), right.begin(), right.end());
+    EXPECT_EQ(expected, left);
+}
+
+TEST(btree, erase)
+{
+    // Few distinct keys, so many elements have keys equal to separators
+    for (std::uint64_t max_key : { 50, 1000000 })
+    {
+        storage::memory<std::string> mem;
+        bptree::b_tree<std::uint64_t, std::uint64_t> tree(mem, 3);
+
+        std::default_random_engine generator;
+        std::uniform_int_distribution<std::uint64_t> distribution(1, max_key);
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> added, expected;
+        for (std::uint64_t i = 0; i < 5000; ++i)
+        {
+            auto x = std::make_pair(distribution(generator), i);
+            tree.add(x.first, x.second);
+            added.push_back(x);
+
+            // Erase one of the recent or one of the old elements
+            if (i % 2 == 1)
+            {
+                std::size_t j = added.size() - 1 - generator() % std::min<std::size_t>(added.size(), i % 4 == 1 ? 3 : added.size());
+                tree.erase(added[j].first, added[j].second);
+                added.erase(added.begin() + j);
+            }
+        }
+
+        std::sort(added.begin(), added.end());
+        auto v = from_tree(tree);
+        std::sort(v.begin(), v.end());
+        EXPECT_EQ(added, v);
+    }
+}
+
+TEST(btree, string_keys)
+{
+    std::size_t t = 8;
+    storage::memory<std::string> mem;
+    bptree::b_tree<std::string, std::uint64_t> tree(mem, t, boost::none, bptree::serialize_slotted, bptree::deserialize_slotted);
+
+    // Composite keys share long prefixes
+    auto key = [] (std::uint64_t tenant, std::uint64_t timestamp)
+    {
+        char buffer[64];
+        std::snprintf(buffer, sizeof(buffer), "tenant-%03llu/priority-%llu/%012llu",
+                      (unsigned long long) tenant, (unsigned long long) (tenant % 3), (unsigned long long) timestamp);
+        return std::string(buffer);
+    };
+    std::default_random_engine generator;
+    std::vector<std::pair<std::string, std::uint64_t>> added;
+    for (std::uint64_t i = 0; i < 5000; ++i)
+    {
+        added.push_back({ key(generator() % 20, generator() % 1000000), i });
+        tree.add(added.back().first, added.back().second);
+        if (i % 5 == 4)
+        {
+            std::size_t j = generator() % added.size();
+            tree.erase(added[j].first, added[j].second);
+            added.erase(added.begin() + j);
+        }
+    }
+    tree.flush_cache();
+
+    auto shape = bptree::inspect<std::string, std::uint64_t, std::string>(mem, tree.root_id(), bptree::deserialize_slotted);
+    ASSERT_GT(shape.depth(), 2u);
+    EXPECT_EQ(0u, shape.misplaced);
+    auto root_kind = bptree::classify(*mem.load_node(*tree.root_id()));
+    EXPECT_EQ("buffer", root_kind.type);
+    EXPECT_EQ(shape.depth() - 1, root_kind.level);
+
+    // Separators in the root are prefixes just long enough to tell children apart,
+    // keys of pages are found without deserializing them
+    auto root_serialized = mem.load_node(*tree.root_id());
+    bptree::slotted_page root(*root_serialized);
+    EXPECT_FALSE(root.leaf());
+    ASSERT_GT(root.size(), 0u);
+    auto root_data = std::unique_ptr<detail::b_node_data<std::string, std::uint64_t>>(
+                bptree::deserialize_slotted(root_serialized.get()));
+    auto & keys = dynamic_cast<detail::b_buffer_data<std::string, std::uint64_t> &>(*root_data).keys_;
+    for (std::size_t i = 0; i < root.size(); ++i)
+    {
+        EXPECT_EQ(keys[i].first, root.key(i));
+        EXPECT_EQ(keys[i].second, root.value(i));
+        EXPECT_LT(keys[i].first.size(), key(0, 0).size());
+        EXPECT_EQ(i, root.lower_bound(keys[i].first));
+    }
+    EXPECT_EQ(0u, root.lower_bound(""));
+    EXPECT_EQ(root.size(), root.lower_bound("u"));
+
+    // Leaves store the common prefix of their keys once
+    storage::node_id id = *tree.root_id();
+    while (!bptree::slotted_page(*mem.load_node(id)).leaf())
+    {
+        auto data = std::unique_ptr<detail::b_node_data<std::string, std::uint64_t>>(
+                    bptree::deserialize_slotted(mem.load_node(id).get()));
+        id = dynamic_cast<detail::b_buffer_data<std::string, std::uint64_t> &>(*data).children_.front();
+    }
+    auto serialized = mem.load_node(id);
+    bptree::slotted_page leaf(*serialized);
+    EXPECT_GE(leaf.prefix().size(), std::string("tenant-00").size());
+    std::size_t full = 0;
+    for (std::size_t i = 0; i < leaf.size(); ++i)
+        full += leaf.key(i).size() + sizeof(std::uint64_t);
+    EXPECT_LT(serialized->size(), full);
+    std::unique_ptr<detail::b_node_data<std::string, std::uint64_t>> leaf_data(bptree::deserialize_slotted(serialized.get()));
+    std::unique_ptr<std::string> again(bptree::serialize_slotted(leaf_data.get()));
+    EXPECT_EQ(*serialized, *again);
+
+    std::sort(added.begin(), added.end());
+    auto v = from_tree(tree);
+    std::sort(v.begin(), v.end());
+    EXPECT_EQ(added, v);
+
+    // Bulk loaded tree gets short separators as well
+    bptree::b_tree<std::string, std::uint64_t> loaded(mem, t, boost::none, bptree::serialize_slotted, bptree::deserialize_slotted);
+    std::size_t i = 0;
+    loaded.bulk_load(added.size(), [&added, &i] { return added[i++]; });
+    loaded.flush_cache();
+    auto loaded_serialized = mem.load_node(*loaded.root_id());
+    bptree::slotted_page loaded_root(*loaded_serialized);
+    for (std::size_t j = 0; j < loaded_root.size(); ++j)
+        EXPECT_LT(loaded_root.key(j).size(), key(0, 0).size());
+    v = from_tree(loaded);
+    std::sort(v.begin(), v.end());
+    EXPECT_EQ(added, v);
+}
+
+TEST(btree, erase_duplicates)
+{
+    // Identical elements, erased and added again, every tombstone removes one copy
+    storage::memory<std::string> mem;
+    bptree::b_tree<std::uint64_t, std::uint64_t> tree(mem, 3);
+
+    std::default_random_engine generator;
+    std::multiset<std::pair<std::uint64_t, std::uint64_t>> expected;
+    for (std::size_t i = 0; i < 20000; ++i)
+    {
+        auto x = std::make_pair(generator() % 20, generator() % 3);
+        if (i % 3 == 2 && expected.count(x) > 0)
+        {
+            tree.erase(x.first, x.second);
+            expected.erase(expected.find(x));
+        }
+        else
+        {
+            tree.add(x.first, x.second);
+            expected.insert(x);
+        }
+    }
+
+    auto v = from_tree(tree);
+    std::sort(v.begin(), v.end());
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> expected_values(expected.begin(), expected.end());
+    EXPECT_EQ(expected_values, v);
+}
+
 int main(int argc, char ** argv)
 {
     testing::InitGoogleTest(&argc, argv);
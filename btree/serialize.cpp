@@ -1,7 +1,9 @@
 #include "serialize.h"
+#include "slotted_page.h"
 
 #include <boost/optional.hpp>
 #include <queue>
+#include <limits>
 
 namespace bptree
 {
@@ -35,7 +37,10 @@ std::string * serialize(detail::b_node_data<std::uint64_t, std::uint64_t> * data
         for (auto child : buffer_data->children_)
             buffer->add_child(child);
         for (auto key : buffer_data->keys_)
-            buffer->add_key(key);
+        {
+            buffer->add_key(key.first);
+            buffer->add_key_value(key.second);
+        }
         std::queue<std::pair<std::uint64_t, std::uint64_t>> cache;
         while (!buffer_data->pending_add_.empty())
         {
@@ -47,6 +52,16 @@ std::string * serialize(detail::b_node_data<std::uint64_t, std::uint64_t> * data
             cache.push(x);
         }
         buffer_data->pending_add_.swap(cache);
+        while (!buffer_data->pending_erase_.empty())
+        {
+            auto x = buffer_data->pending_erase_.front();
+            buffer_data->pending_erase_.pop();
+            btree::KV * kv = buffer->add_erased();
+            kv->set_key(x.first);
+            kv->set_value(x.second);
+            cache.push(x);
+        }
+        buffer_data->pending_erase_.swap(cache);
         node.set_allocated_buffer(buffer);
     }
     else
@@ -81,21 +96,44 @@ detail::b_node_data<std::uint64_t, std::uint64_t> * deserialize(std::string * se
         boost::optional<storage::node_id> parent;
         if (buffer.has_parent_id())
             parent = buffer.parent_id();
-        std::vector<std::uint64_t> keys;
-        for (auto k : buffer.key())
-            keys.push_back(k);
+        // Old separators send elements with equal keys to the left
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> keys;
+        for (int i = 0; i < buffer.key_size(); ++i)
+            keys.push_back({ buffer.key(i), buffer.key_value_size() == buffer.key_size()
+                             ? buffer.key_value(i) : std::numeric_limits<std::uint64_t>::max() });
         std::vector<storage::node_id> children;
         for (auto c : buffer.child())
             children.push_back(c);
         std::queue<std::pair<std::uint64_t, std::uint64_t>> pending;
         for (auto v : buffer.pending())
             pending.push({v.key(), v.value()});
+        std::queue<std::pair<std::uint64_t, std::uint64_t>> erased;
+        for (auto v : buffer.erased())
+            erased.push({v.key(), v.value()});
         return new detail::b_buffer_data<std::uint64_t, std::uint64_t>(
                     buffer.id(), parent, buffer.level(),
-                    keys, children, pending
+                    keys, children, pending, erased
         );
     }
 
     throw std::runtime_error("Unknown serialized node type");
 }
+
+storage::node_kind classify(const std::string & serialized)
+{
+    if (slotted_page::is_slotted(serialized))
+    {
+        slotted_page page(serialized);
+        return storage::node_kind{ page.leaf() ? "leaf" : "buffer", page.level() };
+    }
+    btree::BNode node;
+    if (node.ParseFromString(serialized))
+    {
+        if (node.has_leaf())
+            return storage::node_kind{ "leaf", node.leaf().level() };
+        if (node.has_buffer())
+            return storage::node_kind{ "buffer", node.buffer().level() };
+    }
+    return storage::node_kind{ "other", 0 };
+}
 }
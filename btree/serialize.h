@@ -3,6 +3,7 @@
 #include "serialize/btree.pb.h"
 #include "btree_data.h"
 
+#include <storage/node_kind.h>
 #include <utils/undefined.h>
 
 #include <exception>
@@ -11,4 +12,8 @@ namespace bptree
 {
 std::string * serialize(detail::b_node_data<std::uint64_t, std::uint64_t> * data);
 detail::b_node_data<std::uint64_t, std::uint64_t> * deserialize(std::string * serialized);
+// Kind of serialized node for storage::counting: leaf or buffer with its level,
+// slotted pages of trees with string keys are recognized as well, other data
+// in the storage (e.g. heap superblock) is of kind "other"
+storage::node_kind classify(const std::string & serialized);
 }
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "btree_data.h"
+
+#include <storage/basic_storage.h>
+
+#include <boost/optional.hpp>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <ostream>
+#include <algorithm>
+
+namespace bptree
+{
+// Nodes of one level of a tree
+struct level_shape
+{
+    std::size_t nodes = 0;
+    // Number of nodes by number of children (buffers) or elements (leaves)
+    std::map<std::size_t, std::size_t> fanout;
+    // Pending adds and tombstones in buffers of the level
+    std::size_t pending_adds = 0;
+    std::size_t pending_erases = 0;
+    std::size_t max_pending = 0;
+    std::size_t nonempty_buffers = 0;
+};
+
+struct tree_shape
+{
+    // Levels from leaves (0) up to the root
+    std::vector<level_shape> levels;
+    // Elements in leaves, pending adds are not counted
+    std::size_t elements = 0;
+    // Nodes whose level is not one less than their parent's, should be 0
+    std::size_t misplaced = 0;
+
+    std::size_t depth() const
+    {
+        return levels.size();
+    }
+};
+
+// Collect shape of the tree with the given root, load returns data of a node by its id
+template <typename Key, typename Value>
+tree_shape inspect(const boost::optional<storage::node_id> & root,
+                   std::function<std::shared_ptr<detail::b_node_data<Key, Value>>(storage::node_id)> load)
+{
+    tree_shape result;
+    if (!root)
+        return result;
+
+    // Nodes to visit with their expected levels
+    std::vector<std::pair<storage::node_id, std::size_t>> stack;
+    std::shared_ptr<detail::b_node_data<Key, Value>> node = load(*root);
+    result.levels.resize(node->level_ + 1);
+    stack.push_back({ *root, node->level_ });
+    while (!stack.empty())
+    {
+        auto x = stack.back();
+        stack.pop_back();
+        node = load(x.first);
+        if (node->level_ != x.second || node->level_ >= result.levels.size())
+        {
+            ++result.misplaced;
+            continue;
+        }
+
+        level_shape & level = result.levels[node->level_];
+        ++level.nodes;
+        if (auto leaf = std::dynamic_pointer_cast<detail::b_leaf_data<Key, Value>>(node))
+        {
+            ++level.fanout[leaf->values_.size()];
+            result.elements += leaf->values_.size();
+            continue;
+        }
+
+        auto buffer = std::dynamic_pointer_cast<detail::b_buffer_data<Key, Value>>(node);
+        ++level.fanout[buffer->children_.size()];
+        std::size_t pending = buffer->pending_add_.size() + buffer->pending_erase_.size();
+        level.pending_adds += buffer->pending_add_.size();
+        level.pending_erases += buffer->pending_erase_.size();
+        level.max_pending = std::max(level.max_pending, pending);
+        if (pending > 0)
+            ++level.nonempty_buffers;
+        if (x.second == 0)
+        {
+            ++result.misplaced;
+            continue;
+        }
+        for (auto child : buffer->children_)
+            stack.push_back({ child, x.second - 1 });
+    }
+    return result;
+}
+
+// Collect shape of the tree from nodes written to the storage
+template <typename Key, typename Value, typename Serialized>
+tree_shape inspect(const storage::basic_storage<Serialized> & storage,
+                   const boost::optional<storage::node_id> & root,
+                   std::function<detail::b_node_data<Key, Value> *(Serialized *)> deserializer)
+{
+    return inspect<Key, Value>(root, [&storage, &deserializer] (storage::node_id id)
+    {
+        std::shared_ptr<Serialized> serialized = storage.load_node(id);
+        return std::shared_ptr<detail::b_node_data<Key, Value>>(deserializer(serialized.get()));
+    });
+}
+
+// Print levels from the root down: number of nodes, fanout, and for buffers
+// pending elements relative to t, the size at which a buffer is flushed
+inline void print(std::ostream & out, const tree_shape & shape, std::size_t t)
+{
+    out << "Depth: " << shape.depth() << ", elements in leaves: " << shape.elements;
+    if (shape.misplaced > 0)
+        out << ", misplaced nodes: " << shape.misplaced;
+    out << std::endl;
+
+    for (std::size_t i = shape.levels.size(); i-- > 0; )
+    {
+        const level_shape & level = shape.levels[i];
+        std::size_t total = 0;
+        for (auto & f : level.fanout)
+            total += f.first * f.second;
+
+        out << "Level " << i << (i == 0 ? " (leaves)" : "") << ": " << level.nodes << " nodes, "
+            << (i == 0 ? "elements" : "children") << " per node "
+            << (level.nodes == 0 ? 0.0 : double(total) / level.nodes);
+        if (!level.fanout.empty())
+            out << " (" << level.fanout.begin()->first << ".." << level.fanout.rbegin()->first << ")";
+        out << std::endl;
+
+        if (i > 0)
+        {
+            double pending = double(level.pending_adds + level.pending_erases);
+            out << "    pending: " << level.pending_adds << " adds, " << level.pending_erases << " tombstones, "
+                << (level.nodes == 0 ? 0.0 : 100 * pending / level.nodes / t) << "% of t per buffer, max "
+                << level.max_pending << ", nonempty buffers " << level.nonempty_buffers << std::endl;
+        }
+
+        out << "    fanout:";
+        for (auto & f : level.fanout)
+            out << " " << f.first << "x" << f.second;
+        out << std::endl;
+    }
+}
+}
@@ -0,0 +1,301 @@
+#include "slotted_page.h"
+
+#include <algorithm>
+#include <cstring>
+#include <queue>
+#include <stdexcept>
+
+namespace bptree
+{
+namespace
+{
+// First byte can't start a protobuf message of the other serializer
+const char magic[] = { '\xff', 'S', 'P', 'G' };
+
+enum : std::size_t
+{
+    type_offset = 4,
+    has_parent_offset = 5,
+    id_offset = 8,
+    parent_offset = 16,
+    level_offset = 24,
+    prefix_size_offset = 28,
+    slot_count_offset = 32,
+    children_count_offset = 36,
+    pending_count_offset = 40,
+    erased_count_offset = 44,
+    // Offset of children and pending elements that follow the records
+    tail_offset = 48,
+    header_size = 52
+};
+
+enum : char
+{
+    leaf_type = 0,
+    buffer_type = 1
+};
+
+// Integers are little-endian
+template <typename T>
+void put(std::string & out, std::size_t offset, T x)
+{
+    for (std::size_t i = 0; i < sizeof(T); ++i)
+        out[offset + i] = char((x >> (8 * i)) & 0xff);
+}
+
+template <typename T>
+void append(std::string & out, T x)
+{
+    out.resize(out.size() + sizeof(T));
+    put(out, out.size() - sizeof(T), x);
+}
+
+template <typename T>
+T get(const std::string & in, std::size_t offset)
+{
+    if (offset + sizeof(T) > in.size())
+        throw std::runtime_error("Slotted page is truncated");
+    T x = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i)
+        x |= T(static_cast<unsigned char>(in[offset + i])) << (8 * i);
+    return x;
+}
+
+// Lengths of keys take one byte for keys shorter than 128 bytes
+void append_length(std::string & out, std::size_t n)
+{
+    while (n >= 0x80)
+    {
+        out.push_back(char((n & 0x7f) | 0x80));
+        n >>= 7;
+    }
+    out.push_back(char(n));
+}
+
+std::size_t get_length(const std::string & in, std::size_t & offset)
+{
+    std::size_t n = 0;
+    for (std::size_t shift = 0; ; shift += 7)
+    {
+        if (offset >= in.size() || shift > 63)
+            throw std::runtime_error("Slotted page is truncated");
+        auto byte = static_cast<unsigned char>(in[offset++]);
+        n |= std::size_t(byte & 0x7f) << shift;
+        if (byte < 0x80)
+            return n;
+    }
+}
+
+void append_key(std::string & out, const std::string & key)
+{
+    append_length(out, key.size());
+    out += key;
+}
+
+std::string get_key(const std::string & in, std::size_t & offset)
+{
+    std::size_t n = get_length(in, offset);
+    if (offset + n > in.size())
+        throw std::runtime_error("Slotted page is truncated");
+    offset += n;
+    return in.substr(offset - n, n);
+}
+
+std::string common_prefix(const std::string & a, const std::string & b)
+{
+    return a.substr(0, std::mismatch(a.begin(), a.end(), b.begin(), b.end()).first - a.begin());
+}
+
+// Header, prefix and slots of sorted elements
+std::string * write_page(char type, const detail::b_node_data<std::string, std::uint64_t> & data,
+                         const std::vector<std::pair<std::string, std::uint64_t>> & elements)
+{
+    std::size_t count = elements.size();
+    std::string prefix = count == 0 ? std::string() : common_prefix(elements.front().first, elements.back().first);
+    std::string * page = new std::string(magic, sizeof(magic));
+    page->resize(header_size + prefix.size() + 4 * count);
+    (*page)[type_offset] = type;
+    (*page)[has_parent_offset] = data.parent_ ? 1 : 0;
+    put<std::uint64_t>(*page, id_offset, data.id_);
+    put<std::uint64_t>(*page, parent_offset, data.parent_ ? *data.parent_ : 0);
+    put<std::uint32_t>(*page, level_offset, data.level_);
+    put<std::uint32_t>(*page, prefix_size_offset, prefix.size());
+    put<std::uint32_t>(*page, slot_count_offset, count);
+    page->replace(header_size, prefix.size(), prefix);
+
+    std::size_t slots = header_size + prefix.size();
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        put<std::uint32_t>(*page, slots + 4 * i, page->size());
+        const std::string & k = elements[i].first;
+        append_length(*page, k.size() - prefix.size());
+        page->append(k, prefix.size(), std::string::npos);
+        append<std::uint64_t>(*page, elements[i].second);
+    }
+    put<std::uint32_t>(*page, tail_offset, page->size());
+    return page;
+}
+}
+
+bool slotted_page::is_slotted(const std::string & serialized)
+{
+    return serialized.size() >= header_size && std::equal(magic, magic + sizeof(magic), serialized.begin());
+}
+
+slotted_page::slotted_page(const std::string & serialized)
+    : page(serialized)
+{
+    if (!is_slotted(serialized))
+        throw std::runtime_error("Not a slotted page");
+    if (header_size + prefix().size() + 4 * size() > page.size())
+        throw std::runtime_error("Slotted page is truncated");
+}
+
+bool slotted_page::leaf() const
+{
+    return page[type_offset] == leaf_type;
+}
+
+std::size_t slotted_page::level() const
+{
+    return get<std::uint32_t>(page, level_offset);
+}
+
+storage::node_id slotted_page::id() const
+{
+    return get<std::uint64_t>(page, id_offset);
+}
+
+boost::optional<storage::node_id> slotted_page::parent() const
+{
+    if (page[has_parent_offset] == 0)
+        return boost::none;
+    return get<std::uint64_t>(page, parent_offset);
+}
+
+std::string slotted_page::prefix() const
+{
+    return page.substr(header_size, get<std::uint32_t>(page, prefix_size_offset));
+}
+
+std::size_t slotted_page::size() const
+{
+    return get<std::uint32_t>(page, slot_count_offset);
+}
+
+std::pair<const char *, std::size_t> slotted_page::suffix(std::size_t i) const
+{
+    std::size_t slots = header_size + get<std::uint32_t>(page, prefix_size_offset);
+    std::size_t offset = get<std::uint32_t>(page, slots + 4 * i);
+    std::size_t n = get_length(page, offset);
+    if (offset + n > page.size())
+        throw std::runtime_error("Slotted page is truncated");
+    return { page.data() + offset, n };
+}
+
+std::string slotted_page::key(std::size_t i) const
+{
+    auto s = suffix(i);
+    return prefix().append(s.first, s.second);
+}
+
+std::uint64_t slotted_page::value(std::size_t i) const
+{
+    auto s = suffix(i);
+    return get<std::uint64_t>(page, s.first + s.second - page.data());
+}
+
+std::size_t slotted_page::lower_bound(const std::string & key) const
+{
+    // Keys with a different prefix are all less or all greater than keys of the page
+    std::size_t prefix_size = get<std::uint32_t>(page, prefix_size_offset);
+    int c = key.compare(0, prefix_size, page, header_size, prefix_size);
+    if (c != 0)
+        return c < 0 ? 0 : size();
+
+    std::size_t first = 0, last = size();
+    while (first < last)
+    {
+        std::size_t middle = first + (last - first) / 2;
+        auto s = suffix(middle);
+        if (key.compare(prefix_size, std::string::npos, s.first, s.second) > 0)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    return first;
+}
+
+std::string * serialize_slotted(detail::b_node_data<std::string, std::uint64_t> * data)
+{
+    using element = std::pair<std::string, std::uint64_t>;
+    if (auto leaf = dynamic_cast<detail::b_leaf_data<std::string, std::uint64_t> *>(data))
+        return write_page(leaf_type, *leaf, leaf->values_);
+
+    if (auto buffer = dynamic_cast<detail::b_buffer_data<std::string, std::uint64_t> *>(data))
+    {
+        std::string * page = write_page(buffer_type, *buffer, buffer->keys_);
+        put<std::uint32_t>(*page, children_count_offset, buffer->children_.size());
+        put<std::uint32_t>(*page, pending_count_offset, buffer->pending_add_.size());
+        put<std::uint32_t>(*page, erased_count_offset, buffer->pending_erase_.size());
+        for (auto child : buffer->children_)
+            append<std::uint64_t>(*page, child);
+        for (auto pending : { &buffer->pending_add_, &buffer->pending_erase_ })
+        {
+            std::queue<element> cache;
+            while (!pending->empty())
+            {
+                append_key(*page, pending->front().first);
+                append<std::uint64_t>(*page, pending->front().second);
+                cache.push(std::move(pending->front()));
+                pending->pop();
+            }
+            pending->swap(cache);
+        }
+        return page;
+    }
+
+    throw std::logic_error("Unknown node type");
+}
+
+detail::b_node_data<std::string, std::uint64_t> * deserialize_slotted(std::string * serialized)
+{
+    using element = std::pair<std::string, std::uint64_t>;
+    slotted_page page(*serialized);
+    if (page.leaf())
+    {
+        std::vector<element> values;
+        values.reserve(page.size());
+        for (std::size_t i = 0; i < page.size(); ++i)
+            values.push_back({ page.key(i), page.value(i) });
+        return new detail::b_leaf_data<std::string, std::uint64_t>(page.id(), page.parent(), page.level(), values);
+    }
+
+    std::vector<element> keys;
+    keys.reserve(page.size());
+    for (std::size_t i = 0; i < page.size(); ++i)
+        keys.push_back({ page.key(i), page.value(i) });
+
+    std::size_t offset = get<std::uint32_t>(*serialized, tail_offset);
+    std::vector<storage::node_id> children(get<std::uint32_t>(*serialized, children_count_offset));
+    for (auto & child : children)
+    {
+        child = get<std::uint64_t>(*serialized, offset);
+        offset += 8;
+    }
+    std::queue<element> pending[2];
+    std::size_t counts[2] = { get<std::uint32_t>(*serialized, pending_count_offset),
+                              get<std::uint32_t>(*serialized, erased_count_offset) };
+    for (std::size_t i = 0; i < 2; ++i)
+        for (std::size_t j = 0; j < counts[i]; ++j)
+        {
+            std::string key = get_key(*serialized, offset);
+            pending[i].push({ std::move(key), get<std::uint64_t>(*serialized, offset) });
+            offset += 8;
+        }
+    return new detail::b_buffer_data<std::string, std::uint64_t>(
+                page.id(), page.parent(), page.level(),
+                keys, children, pending[0], pending[1]
+    );
+}
+}
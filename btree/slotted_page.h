@@ -0,0 +1,51 @@
+#pragma once
+
+#include "btree_data.h"
+
+#include <storage/node_id.h>
+
+#include <boost/optional.hpp>
+#include <string>
+#include <cstdint>
+
+namespace bptree
+{
+// Serialized node of a tree with string keys: a header, the common prefix of all keys
+// of the node, a directory of slots with offsets of records and the records themselves.
+// A record is a key without the prefix and a value: an element of a leaf or a separator
+// of a buffer. Children and pending elements of a buffer follow the records, pending keys
+// are stored in full.
+// Slots have fixed size, so a key can be read or searched for without deserializing
+// the whole node.
+struct slotted_page
+{
+    // Throws if serialized is not a slotted page, serialized should outlive the page
+    slotted_page(const std::string & serialized);
+
+    static bool is_slotted(const std::string & serialized);
+
+    bool leaf() const;
+    std::size_t level() const;
+    storage::node_id id() const;
+    boost::optional<storage::node_id> parent() const;
+
+    // Common prefix of all keys (separators for buffers)
+    std::string prefix() const;
+    // Number of keys (separators for buffers)
+    std::size_t size() const;
+    std::string key(std::size_t i) const;
+    // Value of i-th element (separator for buffers)
+    std::uint64_t value(std::size_t i) const;
+    // Index of the first key that is not less than key
+    std::size_t lower_bound(const std::string & key) const;
+
+private:
+    // Key without the prefix
+    std::pair<const char *, std::size_t> suffix(std::size_t i) const;
+
+    const std::string & page;
+};
+
+std::string * serialize_slotted(detail::b_node_data<std::string, std::uint64_t> * data);
+detail::b_node_data<std::string, std::uint64_t> * deserialize_slotted(std::string * serialized);
+}
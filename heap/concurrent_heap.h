@@ -0,0 +1,293 @@
+#pragma once
+
+#include "small_set.h"
+
+#include <btree/btree.h>
+#include <storage/directory.h>
+
+#include <boost/optional.hpp>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <functional>
+
+namespace data
+{
+// Heap for several producer and consumer threads
+// Small elements are spread over several small sets, each with its own lock.
+// Big elements are collected in insertion buffers (one per thread, threads are
+// mapped to buffers by their ids) and added to the tree by batches with concurrent_add.
+// Invariant: all elements of small sets are not greater than small_max, all elements
+// of buffers and of the tree are not less than it. Only refill from the tree and
+// moving elements out of an overflowed small set change small_max, they take
+// the whole heap exclusively.
+template <typename Key, typename Value, typename Serialized = std::string>
+struct concurrent_heap
+{
+    using tree_t = bptree::b_tree<Key, Value, Serialized>;
+
+    concurrent_heap(std::size_t t,
+                    const fs::path & path,
+                    std::size_t sets_count = 2 * std::thread::hardware_concurrency(),
+                    std::size_t buffer_size = 64,
+                    std::size_t cache_size = 3)
+        : concurrent_heap(std::unique_ptr<storage::basic_storage<Serialized>>(new storage::directory<Serialized>(path)),
+                          t, sets_count, buffer_size, cache_size)
+    {}
+
+    // Heap in the storage owned by the caller, storage should outlive the heap
+    concurrent_heap(storage::basic_storage<Serialized> & storage,
+                    std::size_t t,
+                    std::size_t sets_count = 2 * std::thread::hardware_concurrency(),
+                    std::size_t buffer_size = 64,
+                    std::size_t cache_size = 3)
+        : concurrent_heap(nullptr, storage, t, sets_count, buffer_size, cache_size)
+    {}
+
+    concurrent_heap(const concurrent_heap & other) = delete;
+
+    ~concurrent_heap()
+    {
+        big.flush_cache();
+    }
+
+    void add(Key k, Value v)
+    {
+        std::shared_lock<std::shared_timed_mutex> latch(heap_latch);
+        ++size_;
+
+        if (k < small_max)
+        {
+            small_set_t & set = sets[random_index()];
+            std::unique_lock<std::mutex> lock(set.mutex);
+            if (set.elements.size() < small_size)
+            {
+                set.elements.insert({ k, v });
+                return;
+            }
+        }
+        else
+        {
+            buffer_t & buffer = buffers[std::hash<std::thread::id>()(std::this_thread::get_id()) % buffers.size()];
+            std::vector<std::pair<Key, Value>> batch;
+            {
+                std::lock_guard<std::mutex> lock(buffer.mutex);
+                buffer.elements.push_back({ k, v });
+                if (buffer.elements.size() < buffer_size)
+                    return;
+                batch.swap(buffer.elements);
+            }
+
+            for (auto & x : batch)
+                big.concurrent_add(x.first, x.second);
+            big_size += batch.size();
+            return;
+        }
+
+        // Small set is full
+        latch.unlock();
+        --size_;
+        std::unique_lock<std::shared_timed_mutex> exclusive(heap_latch);
+        split_small();
+        exclusive.unlock();
+        add(k, v);
+    }
+
+    // Remove minimal element, or return none if heap is empty
+    boost::optional<std::pair<Key, Value>> try_remove_min()
+    {
+        while (true)
+        {
+            {
+                std::shared_lock<std::shared_timed_mutex> latch(heap_latch);
+                std::vector<std::unique_lock<std::mutex>> locks;
+                for (auto & set : sets)
+                    locks.emplace_back(set.mutex);
+
+                small_set_t * min_set = nullptr;
+                for (auto & set : sets)
+                    if (!set.elements.empty()
+                        && (!min_set || set.elements.front() < min_set->elements.front()))
+                        min_set = &set;
+                if (min_set)
+                    return pop(*min_set);
+            }
+
+            if (!refill())
+                return boost::none;
+        }
+    }
+
+    // Remove one of the minimal elements, or return none if heap is empty
+    // The smaller of minimums of two random small sets is removed, so the result is
+    // usually among the smallest sets_count elements, but consumers rarely contend
+    boost::optional<std::pair<Key, Value>> try_remove_min_relaxed()
+    {
+        while (true)
+        {
+            {
+                std::shared_lock<std::shared_timed_mutex> latch(heap_latch);
+                std::size_t i = random_index(), j = random_index();
+                if (i != j)
+                {
+                    std::unique_lock<std::mutex> first(sets[i].mutex, std::defer_lock), second(sets[j].mutex, std::defer_lock);
+                    std::lock(first, second);
+                    auto & a = sets[i].elements;
+                    auto & b = sets[j].elements;
+                    if (!a.empty() && (b.empty() || a.front() < b.front()))
+                        return pop(sets[i]);
+                    if (!b.empty())
+                        return pop(sets[j]);
+                }
+
+                // Both chosen sets are empty, look for any nonempty set
+                for (auto & set : sets)
+                {
+                    std::lock_guard<std::mutex> lock(set.mutex);
+                    if (!set.elements.empty())
+                        return pop(set);
+                }
+            }
+
+            if (!refill())
+                return boost::none;
+        }
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+private:
+    struct small_set_t
+    {
+        std::mutex mutex;
+        detail::small_set<Key, Value> elements;
+    };
+
+    struct buffer_t
+    {
+        std::mutex mutex;
+        std::vector<std::pair<Key, Value>> elements;
+    };
+
+    concurrent_heap(std::unique_ptr<storage::basic_storage<Serialized>> && owned,
+                    std::size_t t,
+                    std::size_t sets_count,
+                    std::size_t buffer_size,
+                    std::size_t cache_size)
+        : concurrent_heap(std::move(owned), *owned, t, sets_count, buffer_size, cache_size)
+    {}
+
+    concurrent_heap(std::unique_ptr<storage::basic_storage<Serialized>> && owned,
+                    storage::basic_storage<Serialized> & storage,
+                    std::size_t t,
+                    std::size_t sets_count,
+                    std::size_t buffer_size,
+                    std::size_t cache_size)
+        : small_size(2 * t)
+        , buffer_size(buffer_size)
+        , small_max(std::numeric_limits<Key>::max())
+        , sets(std::max<std::size_t>(sets_count, 1))
+        , buffers(sets.size())
+        , size_(0)
+        , big_size(0)
+        , owned_storage(std::move(owned))
+        , big(storage, t, boost::none, bptree::serialize, bptree::deserialize, cache_size)
+    {}
+
+    std::pair<Key, Value> pop(small_set_t & set)
+    {
+        auto result = set.elements.front();
+        set.elements.pop_front();
+        --size_;
+        return result;
+    }
+
+    std::size_t random_index()
+    {
+        thread_local std::minstd_rand generator(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        return generator() % sets.size();
+    }
+
+    // Move the bigger half of the fullest small set to the tree
+    // Elements not less than the new small_max are moved from other sets too
+    void split_small()
+    {
+        small_set_t * full = &sets.front();
+        for (auto & set : sets)
+            if (set.elements.size() > full->elements.size())
+                full = &set;
+        if (full->elements.size() < small_size)
+            return;
+
+        small_max = std::next(full->elements.begin(), small_size / 2)->first;
+        for (auto & set : sets)
+            while (!set.elements.empty() && !(set.elements.back().first < small_max))
+            {
+                big.add(set.elements.back().first, set.elements.back().second);
+                set.elements.pop_back();
+                ++big_size;
+            }
+    }
+
+    // Move left leaves of the tree to empty small sets
+    // Returns false if there is nothing to move
+    bool refill()
+    {
+        std::unique_lock<std::shared_timed_mutex> exclusive(heap_latch);
+        for (auto & set : sets)
+            if (!set.elements.empty())
+                return true;
+
+        for (auto & buffer : buffers)
+        {
+            for (auto & x : buffer.elements)
+                big.add(x.first, x.second);
+            big_size += buffer.elements.size();
+            buffer.elements.clear();
+        }
+
+        if (big_size == 0)
+            return false;
+
+        std::vector<std::pair<Key, Value>> leaves;
+        while (big_size > 0 && leaves.size() < sets.size())
+        {
+            std::size_t before = leaves.size();
+            big.remove_left_leaf(std::back_inserter(leaves));
+            big_size -= leaves.size() - before;
+        }
+
+        // Leaves are sorted, so every set gets a sorted sequence
+        for (std::size_t i = 0; i < leaves.size(); ++i)
+            sets[i % sets.size()].elements.push_back(leaves[i]);
+        small_max = leaves.back().first;
+        return true;
+    }
+
+    std::size_t small_size;
+    std::size_t buffer_size;
+    Key small_max;
+    std::vector<small_set_t> sets;
+    std::vector<buffer_t> buffers;
+    std::atomic<std::size_t> size_;
+    std::atomic<std::size_t> big_size;
+    std::shared_timed_mutex heap_latch;
+    std::unique_ptr<storage::basic_storage<Serialized>> owned_storage;
+    tree_t big;
+};
+}
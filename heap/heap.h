@@ -1,43 +1,294 @@
 #pragma once
 
+#include "serialize.h"
+#include "small_set.h"
+#include "trace.h"
+
 #include <btree/btree.h>
 #include <storage/directory.h>
 #include <utils/undefined.h>
+#include <utils/probe.h>
 
 #include <vector>
+#include <memory>
 #include <algorithm>
 #include <utility>
 #include <limits>
+#include <queue>
+#include <functional>
+#include <stdexcept>
+#include <cassert>
 
-namespace data
+namespace detail
 {
+// Sorted run: values in memory followed by chunks in the storage,
+// which are read and deleted one by one
 template <typename Key, typename Value>
+struct run_reader
+{
+    std::queue<storage::node_id> chunks;
+    std::vector<std::pair<Key, Value>> values;
+    std::size_t position = 0;
+
+    bool empty() const
+    {
+        return position == values.size() && chunks.empty();
+    }
+
+    template <typename Serialized, typename Deserializer>
+    const std::pair<Key, Value> & front(storage::basic_storage<Serialized> & storage, Deserializer & deserializer)
+    {
+        if (position == values.size())
+        {
+            std::shared_ptr<Serialized> serialized = storage.load_node(chunks.front());
+            std::unique_ptr<b_node_data<Key, Value>> chunk(deserializer(serialized.get()));
+            values = dynamic_cast<b_leaf_data<Key, Value> &>(*chunk).values_;
+            position = 0;
+            storage.delete_node(chunks.front());
+            chunks.pop();
+        }
+
+        return values[position];
+    }
+
+    template <typename Serialized, typename Deserializer>
+    std::pair<Key, Value> next(storage::basic_storage<Serialized> & storage, Deserializer & deserializer)
+    {
+        auto result = front(storage, deserializer);
+        ++position;
+        return result;
+    }
+};
+}
+
+namespace data
+{
+// Number of spills of elements from small set to the tree and refills from the tree
+struct heap_stats
+{
+    std::size_t spills = 0;
+    std::size_t spilled = 0;
+    std::size_t refills = 0;
+    std::size_t refilled = 0;
+};
+
+template <typename Key, typename Value, typename Serialized = std::string>
 struct heap
 {
+    using tree_t = bptree::b_tree<Key, Value, Serialized>;
+    using serializer_t = typename tree_t::serializer_t;
+    using deserializer_t = typename tree_t::deserializer_t;
+    using superblock_serializer_t = std::function<Serialized *(const detail::heap_superblock<Key, Value> &)>;
+    using superblock_deserializer_t = std::function<detail::heap_superblock<Key, Value>(Serialized *)>;
+
+    // Element is identified by its key and value, so pairs of elements
+    // that are erased or whose keys are decreased should be distinct
+    using handle = std::pair<Key, Value>;
+
+    static constexpr std::size_t default_cache_size = 3;
+    // Largest small set of set_memory_budget
+    static constexpr std::size_t max_small_size = 4096;
+
     heap(std::size_t t, Key small_max = std::numeric_limits<Key>::max())
-        : small_size(2 * t)
-        , small_max(small_max)
-        , storage("storage")
-        , big(storage, t)
+        : heap(t, "storage", default_cache_size, small_max)
+    {}
+
+    heap(std::size_t t, const fs::path & path, std::size_t cache_size = default_cache_size,
+         Key small_max = std::numeric_limits<Key>::max())
+        : heap(std::unique_ptr<storage::basic_storage<Serialized>>(new storage::directory<Serialized>(path)),
+               new_superblock(t, small_max), cache_size,
+               bptree::serialize, bptree::deserialize, data::serialize, data::deserialize_superblock)
     {}
 
-    void add(Key k, Value v)
+    // Heap in the storage owned by the caller, storage should outlive the heap
+    heap(storage::basic_storage<Serialized> & storage,
+         std::size_t t,
+         std::size_t cache_size = default_cache_size,
+         Key small_max = std::numeric_limits<Key>::max(),
+         serializer_t serializer = bptree::serialize,
+         deserializer_t deserializer = bptree::deserialize,
+         superblock_serializer_t superblock_serializer = data::serialize,
+         superblock_deserializer_t superblock_deserializer = data::deserialize_superblock)
+        : heap(nullptr, storage, new_superblock(t, small_max), cache_size,
+               serializer, deserializer, superblock_serializer, superblock_deserializer)
+    {}
+
+    // Build heap from unsorted range, see assign
+    template <typename It>
+    heap(It first, It last, std::size_t t, const fs::path & path = "storage", std::size_t run_size = default_run_size)
+        : heap(t, path)
     {
-        if (k < small_max)
-            small_add(k, v);
+        assign(first, last, run_size);
+    }
+
+    heap(const heap & other) = delete;
+
+    // Replace heap contents with elements from unsorted range
+    // Range is read once and cut into sorted runs of run_size elements, runs are written
+    // to the storage (unless the whole range fits in one run) and merged. The smallest elements
+    // become small set, the rest are bulk loaded into the tree bottom-up
+    template <typename It>
+    void assign(It first, It last, std::size_t run_size = default_run_size)
+    {
+        clear();
+
+        std::vector<std::pair<Key, Value>> run;
+        std::vector<detail::run_reader<Key, Value>> runs;
+        std::size_t count = 0;
+        for (; first != last; ++first, ++count)
+        {
+            run.push_back(*first);
+            if (trace)
+                trace->element(run.back().first, run.back().second);
+            if (run.size() == run_size)
+            {
+                runs.push_back(write_run(run));
+                run.clear();
+            }
+        }
+        if (trace)
+            trace->assign(count);
+
+        std::function<std::pair<Key, Value>()> next;
+        std::size_t position = 0;
+        std::priority_queue<std::pair<std::pair<Key, Value>, std::size_t>,
+                std::vector<std::pair<std::pair<Key, Value>, std::size_t>>,
+                std::greater<std::pair<std::pair<Key, Value>, std::size_t>>> heads;
+        if (runs.empty())
+        {
+            std::sort(run.begin(), run.end());
+            next = [&run, &position] () { return run[position++]; };
+        }
         else
-            big_add(k, v);
+        {
+            if (!run.empty())
+                runs.push_back(write_run(run));
+            run.clear();
+
+            // k-way merge of runs
+            for (std::size_t i = 0; i < runs.size(); ++i)
+                heads.push({ runs[i].next(storage, deserializer), i });
+            next = [this, &runs, &heads] ()
+            {
+                auto x = heads.top();
+                heads.pop();
+                if (!runs[x.second].empty())
+                    heads.push({ runs[x.second].next(storage, deserializer), x.second });
+                return x.first;
+            };
+        }
+
+        std::size_t small_count = count <= small_size ? count : small_size / 2;
+        for (std::size_t i = 0; i < small_count; ++i)
+            small.push_back(next());
+
+        big_size = count - small_count;
+        if (big_size > 0)
+        {
+            auto first_big = next();
+            small_max = first_big.first;
+            bool returned = false;
+            big.bulk_load(big_size, [&first_big, &returned, &next] ()
+            {
+                if (returned)
+                    return next();
+                returned = true;
+                return first_big;
+            });
+        }
+    }
+
+    // Reopen heap flushed to the directory: only its superblock is read,
+    // tree nodes are loaded when they are needed
+    static std::unique_ptr<heap> open(const fs::path & path, std::size_t cache_size = default_cache_size)
+    {
+        std::unique_ptr<storage::basic_storage<Serialized>> storage(new storage::directory<Serialized>(path));
+        auto superblock = load_superblock(*storage, data::deserialize_superblock);
+        return std::unique_ptr<heap>(new heap(std::move(storage), superblock, cache_size,
+                bptree::serialize, bptree::deserialize, data::serialize, data::deserialize_superblock));
+    }
+
+    // Reopen heap flushed to the storage owned by the caller
+    static std::unique_ptr<heap> open(storage::basic_storage<Serialized> & storage,
+                                      std::size_t cache_size = default_cache_size,
+                                      serializer_t serializer = bptree::serialize,
+                                      deserializer_t deserializer = bptree::deserialize,
+                                      superblock_serializer_t superblock_serializer = data::serialize,
+                                      superblock_deserializer_t superblock_deserializer = data::deserialize_superblock)
+    {
+        auto superblock = load_superblock(storage, superblock_deserializer);
+        return std::unique_ptr<heap>(new heap(nullptr, storage, superblock, cache_size,
+                serializer, deserializer, superblock_serializer, superblock_deserializer));
+    }
+
+    // Write all cached nodes and then superblock pointing to them
+    // Large set is moved to the tree
+    void flush()
+    {
+        spill_large();
+        big.flush_cache();
+
+        detail::heap_superblock<Key, Value> superblock;
+        superblock.root_ = big.root_id();
+        superblock.t_ = t;
+        superblock.big_size_ = big_size;
+        superblock.small_max_ = small_max;
+        superblock.small_.assign(small.begin(), small.end());
+        std::unique_ptr<Serialized> serialized(superblock_serializer(superblock));
+        storage.write_node(superblock_id, serialized.get());
+    }
+
+    ~heap()
+    {
+        flush();
+    }
+
+    handle add(Key k, Value v)
+    {
+        HEAP_PROBE(heap_add);
+        if (trace)
+            trace->add(k, v);
+        return insert(k, v);
+    }
+
+    // Remove element that is in the heap, h must not be erased already
+    // Elements in the tree are removed by tombstones, which cancel them in the tree buffers,
+    // so a missing element is not noticed and erasing it breaks size() and empty()
+    void erase(const handle & h)
+    {
+        if (trace)
+            trace->erase(h.first, h.second);
+        // Elements equal to small_max can be in both small set and tree
+        if (!(small_max < h.first) && small.erase(h))
+            return;
+        if (!(h.first < large_min) && large.erase(h))
+            return;
+
+        assert(big_size > 0);
+        big.erase(h.first, h.second);
+        --big_size;
+    }
+
+    handle decrease_key(const handle & h, Key new_key)
+    {
+        if (h.first < new_key)
+            throw std::invalid_argument("Trying to increase key of heap element");
+
+        erase(h);
+        return add(new_key, h.second);
     }
 
     std::pair<Key, Value> remove_min()
     {
+        HEAP_PROBE(heap_remove_min);
+        if (trace)
+            trace->remove_min();
+        ++removes;
         if (small.empty())
         {
-            if (big.empty())
+            if (big_size == 0 && large.empty())
                 throw std::runtime_error("Trying to remove minimal element from empty heap");
-            auto out = std::back_inserter(small);
-            big.remove_left_leaf(out);
-            small_max = small.back().first;
+            refill();
         }
 
         auto result = small.front();
@@ -45,44 +296,408 @@ struct heap
         return result;
     }
 
+    // Maximal element
+    // Large set of maximal elements is filled from the right leaf of the tree only
+    // when it is needed, so heaps that don't use max keep no elements in it
+    std::pair<Key, Value> max()
+    {
+        if (large.empty())
+        {
+            if (big_size > 0)
+                refill_large();
+            else if (small.empty())
+                throw std::runtime_error("Trying to get maximal element of empty heap");
+            else
+                return small.back();
+        }
+
+        return large.back();
+    }
+
+    std::pair<Key, Value> remove_max()
+    {
+        if (trace)
+            trace->remove_max();
+        auto result = max();
+        if (!large.empty())
+            large.pop_back();
+        else
+            small.pop_back();
+        return result;
+    }
+
+    // Move up to k minimal elements to out in ascending order
+    // Small set is refilled directly from the tree whenever it becomes empty
+    template <typename OutIter>
+    OutIter remove_min(std::size_t k, OutIter out)
+    {
+        HEAP_PROBE(heap_remove_min);
+        if (trace)
+            trace->remove_min(k);
+        while (k > 0)
+        {
+            if (small.empty())
+            {
+                if (big_size == 0 && large.empty())
+                    break;
+                refill();
+            }
+
+            std::size_t n = std::min(k, small.size());
+            removes += n;
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                *out = small.front();
+                ++out;
+                small.pop_front();
+            }
+            k -= n;
+        }
+
+        return out;
+    }
+
+    // Move all elements of other heap to this heap
+    // Other heap's tree is melded into this heap's tree (see b_tree::meld). If the heaps
+    // are kept in different storages (e.g. directories), tree nodes are copied to this
+    // heap's storage one by one, so melding costs a load and a write per node
+    void meld(heap & other)
+    {
+        spill_large();
+        other.spill_large();
+
+        // Elements of both trees are not less than new small_max
+        Key new_small_max = std::min(small_max, other.small_max);
+        while (!small.empty() && small.back().first > new_small_max)
+        {
+            big_add(small.back().first, small.back().second);
+            small.pop_back();
+        }
+        small_max = new_small_max;
+
+        big.meld(other.big);
+        big_size += other.big_size;
+        other.big_size = 0;
+
+        for (auto & x : other.small)
+            insert(x.first, x.second);
+        other.small.clear();
+    }
+
     bool empty()
     {
-        return small.empty() && big.empty();
+        return small.empty() && big_size == 0 && large.empty();
     }
 
+    // Split budget bytes between small set and the node cache of the tree and adapt spill
+    // and refill sizes to the workload. Small set gets at most max_small_size elements,
+    // since an insertion moves up to half of it, and the rest of the budget is cached
+    // nodes. Both capacities are fixed here, only spill and refill sizes change later
+    void set_memory_budget(std::size_t bytes)
+    {
+        std::size_t element_size = sizeof(std::pair<Key, Value>);
+        std::size_t node_size = 2 * t * element_size;
+        std::size_t reserved = cache_size * node_size + 2 * t * element_size;
+        budget = bytes;
+        small_size = std::max(2 * t, std::min(max_small_size, (bytes > reserved ? bytes - reserved : 0) / element_size));
+        std::size_t used = (small_size + 2 * t) * element_size;
+        big.set_cache_limit(std::max(cache_size, (bytes > used ? bytes - used : 0) / node_size));
+    }
+
+    // Record operations to the trace, or stop recording if trace is null
+    // Trace should outlive the heap or recording. Decrease of key is recorded
+    // as erase and add, meld and queries are not recorded
+    void set_trace(trace_writer * trace)
+    {
+        this->trace = trace;
+    }
+
+    // Shape of the tree of elements between small and large sets
+    bptree::tree_shape shape()
+    {
+        return big.shape();
+    }
+
+    const heap_stats & statistics() const
+    {
+        return stats;
+    }
+
+    std::size_t size() const
+    {
+        return small.size() + big_size + large.size();
+    }
+
+    // Storages allocate node ids starting from 1
+    static constexpr storage::node_id superblock_id = 0;
+
 private:
+
+    heap(std::unique_ptr<storage::basic_storage<Serialized>> owned,
+         const detail::heap_superblock<Key, Value> & superblock,
+         std::size_t cache_size,
+         serializer_t serializer,
+         deserializer_t deserializer,
+         superblock_serializer_t superblock_serializer,
+         superblock_deserializer_t superblock_deserializer)
+        : heap(std::move(owned), *owned, superblock, cache_size,
+               serializer, deserializer, superblock_serializer, superblock_deserializer)
+    {}
+
+    heap(std::unique_ptr<storage::basic_storage<Serialized>> && owned,
+         storage::basic_storage<Serialized> & storage,
+         const detail::heap_superblock<Key, Value> & superblock,
+         std::size_t cache_size,
+         serializer_t serializer,
+         deserializer_t deserializer,
+         superblock_serializer_t superblock_serializer,
+         superblock_deserializer_t superblock_deserializer)
+        : t(superblock.t_)
+        , small_size(2 * superblock.t_)
+        , budget(0)
+        , cache_size(cache_size)
+        , adds(0)
+        , removes(0)
+        , trace(nullptr)
+        , small_max(superblock.small_max_)
+        , small(superblock.small_.begin(), superblock.small_.end())
+        , large_min(std::numeric_limits<Key>::max())
+        , big_size(superblock.big_size_)
+        , owned_storage(std::move(owned))
+        , storage(storage)
+        , serializer(serializer)
+        , deserializer(deserializer)
+        , superblock_serializer(superblock_serializer)
+        , big(storage, superblock.t_, superblock.root_, serializer, deserializer, cache_size)
+    {}
+
+    static detail::heap_superblock<Key, Value> new_superblock(std::size_t t, Key small_max)
+    {
+        detail::heap_superblock<Key, Value> superblock;
+        superblock.t_ = t;
+        superblock.big_size_ = 0;
+        superblock.small_max_ = small_max;
+        return superblock;
+    }
+
+    static detail::heap_superblock<Key, Value> load_superblock(storage::basic_storage<Serialized> & storage,
+                                                               const superblock_deserializer_t & deserializer)
+    {
+        std::shared_ptr<Serialized> serialized = storage.load_node(superblock_id);
+        return deserializer(serialized.get());
+    }
+
+    handle insert(Key k, Value v)
+    {
+        ++adds;
+        if (k < small_max)
+            small_add(k, v);
+        else if (large_min < k)
+            large_add(k, v);
+        else
+            big_add(k, v);
+        return handle(k, v);
+    }
+
     void small_add(Key k, Value v)
     {
-        if (small.size() == small_size)
+        if (small.size() >= small_size)
         {
-            for (size_t i = 0; i < small_size / 2; ++i)
             {
-                auto max = small.back();
-                big_add(max.first, max.second);
-                small.pop_back();
-                small_max = max.first;
+                HEAP_PROBE(spill);
+                std::size_t count = spill_size();
+                HEAP_PROBE_SIZE(spill, count);
+                ++stats.spills;
+                stats.spilled += count;
+                for (size_t i = 0; i < count; ++i)
+                {
+                    auto max = small.back();
+                    big_add(max.first, max.second);
+                    small.pop_back();
+                    small_max = max.first;
+                }
             }
 
             // k can be > small_max now
-            add(k, v);
+            insert(k, v);
+        }
+        else
+        {
+            small.insert(std::make_pair(k, v));
+        }
+    }
+
+    void large_add(Key k, Value v)
+    {
+        if (large.size() == 2 * t)
+        {
+            for (size_t i = 0; i < t; ++i)
+            {
+                big_add(large.front().first, large.front().second);
+                large.pop_front();
+            }
+            large_min = large.front().first;
+
+            // k can be <= large_min now
+            insert(k, v);
         }
         else
+            large.insert(std::make_pair(k, v));
+    }
+
+    static constexpr std::size_t default_run_size = 1 << 20;
+
+    // Remove all elements, tree leaves are read one by one
+    // Elements erased by tombstones leave separators and tombstones in the tree when
+    // big_size is already 0, so the tree is drained until it is empty
+    void clear()
+    {
+        std::vector<std::pair<Key, Value>> removed;
+        while (!big.empty())
         {
-            auto x = std::make_pair(k, v);
-            auto it = std::lower_bound(small.begin(), small.end(), x);
-            small.insert(it, x);
+            big.remove_left_leaf(std::back_inserter(removed));
+            removed.clear();
         }
+        big_size = 0;
+        small.clear();
+        small_max = std::numeric_limits<Key>::max();
+        large.clear();
+        large_min = std::numeric_limits<Key>::max();
+    }
+
+    // Sort run and write it to the storage in chunks
+    detail::run_reader<Key, Value> write_run(std::vector<std::pair<Key, Value>> & run)
+    {
+        std::sort(run.begin(), run.end());
+
+        // Merge reads one chunk of every run at once
+        std::size_t chunk_size = std::max(2 * t - 1, run.size() / 64);
+        detail::run_reader<Key, Value> result;
+        for (std::size_t i = 0; i < run.size(); i += chunk_size)
+        {
+            std::size_t end = std::min(run.size(), i + chunk_size);
+            storage::node_id id = storage.new_node();
+            detail::b_leaf_data<Key, Value> chunk(id, boost::none, 0,
+                    std::vector<std::pair<Key, Value>>(run.begin() + i, run.begin() + end));
+            std::unique_ptr<Serialized> serialized(serializer(&chunk));
+            storage.write_node(id, serialized.get());
+            result.chunks.push(id);
+        }
+        return result;
+    }
+
+    // Move left leaf of the tree (or large set if the tree is empty) to empty small set
+    void refill()
+    {
+        HEAP_PROBE(refill);
+        if (big_size == 0)
+        {
+            for (auto & x : large)
+                small.push_back(x);
+            small_max = small.back().first;
+            large.clear();
+            large_min = std::numeric_limits<Key>::max();
+            return;
+        }
+
+        // Leaves can be emptied by tombstones
+        auto out = std::back_inserter(small);
+        while (small.empty())
+            big.remove_left_leaf(out);
+
+        // Leaf has up to 2 * t - 1 elements
+        std::size_t target = refill_size();
+        while (small.size() < big_size && small.size() < target && small.size() + 2 * t <= small_size)
+            big.remove_left_leaf(out);
+
+        HEAP_PROBE_SIZE(refill, small.size());
+        ++stats.refills;
+        stats.refilled += small.size();
+        big_size -= small.size();
+        small_max = small.back().first;
+    }
+
+    // Without memory budget small set is half emptied on overflow and refilled by one leaf
+    // With budget, the more elements were added since the last spill or refill (compared to
+    // removed), the more elements are spilled and the less are refilled
+    double add_share()
+    {
+        double share = adds + removes == 0 ? 0.5 : double(adds) / (adds + removes);
+        adds = removes = 0;
+        return std::min(0.875, std::max(0.125, share));
+    }
+
+    std::size_t spill_size()
+    {
+        if (budget == 0)
+            return small_size / 2;
+        return std::max<std::size_t>(1, small_size * add_share());
+    }
+
+    std::size_t refill_size()
+    {
+        if (budget == 0)
+            return 0;
+        return small_size * (1 - add_share());
+    }
+
+    // Move right leaf of the tree to empty large set
+    void refill_large()
+    {
+        auto out = std::back_inserter(large);
+        while (large.empty())
+            big.remove_right_leaf(out);
+        big_size -= large.size();
+        large_min = large.front().first;
+    }
+
+    void spill_large()
+    {
+        for (auto & x : large)
+            big_add(x.first, x.second);
+        large.clear();
+        large_min = std::numeric_limits<Key>::max();
     }
 
     void big_add(Key k, Value v)
     {
         big.add(k, v);
+        ++big_size;
     }
 
+    std::size_t t;
+    // Capacity of small set
     std::size_t small_size;
+    std::size_t budget;
+    std::size_t cache_size;
+    // Operations since the last spill or refill
+    std::size_t adds;
+    std::size_t removes;
+    heap_stats stats;
+    trace_writer * trace;
     Key small_max;
-    std::list<std::pair<Key, Value>> small;
-    storage::directory<std::string> storage;
-    bptree::b_tree<Key, Value> big;
+    detail::small_set<Key, Value> small;
+    // Maximal elements taken from the tree by max(), all of them are not less than large_min
+    Key large_min;
+    detail::small_set<Key, Value> large;
+    std::size_t big_size;
+    std::unique_ptr<storage::basic_storage<Serialized>> owned_storage;
+    storage::basic_storage<Serialized> & storage;
+    serializer_t serializer;
+    deserializer_t deserializer;
+    superblock_serializer_t superblock_serializer;
+    tree_t big;
 };
+
+template <typename Key, typename Value, typename Serialized>
+constexpr storage::node_id heap<Key, Value, Serialized>::superblock_id;
+
+template <typename Key, typename Value, typename Serialized>
+constexpr std::size_t heap<Key, Value, Serialized>::default_run_size;
+
+template <typename Key, typename Value, typename Serialized>
+constexpr std::size_t heap<Key, Value, Serialized>::default_cache_size;
+
+template <typename Key, typename Value, typename Serialized>
+constexpr std::size_t heap<Key, Value, Serialized>::max_small_size;
 }
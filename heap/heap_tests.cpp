@@ -1,7 +1,51 @@
 #include "heap.h"
+#include "concurrent_heap.h"
+#include "radix_heap.h"
+#include "sequence_heap.h"
+
+#include <storage/memory.h>
 
 #include <gtest/gtest.h>
 #include <utility>
+#include <random>
+#include <set>
+#include <map>
+#include <chrono>
+#include <limits>
+#include <sstream>
+#include <thread>
+
+TEST(small_set, random)
+{
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::uint64_t> distribution(1, 100);
+    detail::small_set<std::uint64_t, std::uint64_t> set;
+    std::multiset<std::pair<std::uint64_t, std::uint64_t>> expected;
+    for (std::size_t i = 0; i < 10000; ++i)
+    {
+        auto x = distribution(generator);
+        if (x % 3 != 0 || expected.empty())
+        {
+            set.insert({x, i});
+            expected.insert({x, i});
+        }
+        else if (x % 2 == 0)
+        {
+            EXPECT_EQ(set.front(), *expected.begin());
+            set.pop_front();
+            expected.erase(expected.begin());
+        }
+        else
+        {
+            EXPECT_EQ(set.back(), *expected.rbegin());
+            set.pop_back();
+            expected.erase(std::prev(expected.end()));
+        }
+        ASSERT_EQ(set.size(), expected.size());
+    }
+
+    EXPECT_TRUE(std::equal(set.begin(), set.end(), expected.begin()));
+}
 
 TEST(small, descending)
 {
@@ -36,6 +80,653 @@ TEST(small, random)
     EXPECT_EQ(elements, sorted);
 }
 
+TEST(heap, batch_remove)
+{
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::int64_t> distribution(1, 1000);
+    data::heap<std::uint64_t, std::uint64_t> heap(5);
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> elements;
+    for (std::size_t i = 0; i < 1000; ++i)
+    {
+        std::uint64_t x = distribution(generator);
+        heap.add(x, x);
+        elements.push_back({x, x});
+    }
+    std::sort(elements.begin(), elements.end());
+
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> sorted;
+    for (std::size_t k : { 1, 7, 100, 0, 500, 1000 })
+        heap.remove_min(k, std::back_inserter(sorted));
+    EXPECT_TRUE(heap.empty());
+    EXPECT_EQ(elements, sorted);
+}
+
+TEST(heap, assign)
+{
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::int64_t> distribution(1, 100000);
+    for (std::size_t size : { 0, 7, 100, 5000 })
+    {
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> elements;
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            std::uint64_t x = distribution(generator);
+            elements.push_back({x, x});
+        }
+
+        // The last run is not full, the first heap fits in one run
+        for (std::size_t run_size : { std::size_t(10000), std::size_t(300) })
+        {
+            data::heap<std::uint64_t, std::uint64_t> heap(elements.begin(), elements.end(), 4, "storage", run_size);
+            EXPECT_EQ(heap.size(), elements.size());
+            for (std::size_t i = 0; i < 10; ++i)
+                heap.add(i * 1000, i * 1000);
+
+            auto expected = elements;
+            for (std::size_t i = 0; i < 10; ++i)
+                expected.push_back({i * 1000, i * 1000});
+            std::sort(expected.begin(), expected.end());
+
+            std::vector<std::pair<std::uint64_t, std::uint64_t>> sorted;
+            while (!heap.empty())
+                sorted.push_back(heap.remove_min());
+            EXPECT_EQ(expected, sorted);
+        }
+    }
+}
+
+TEST(heap, assign_after_erase)
+{
+    // Elements erased by tombstones leave separators and tombstones in the tree
+    storage::memory<std::string> storage;
+    data::heap<std::uint64_t, std::uint64_t> heap(storage, 4, 16);
+    for (std::uint64_t i = 0; i < 200; ++i)
+        heap.add(i, i);
+    for (std::uint64_t i = 0; i < 200; ++i)
+        heap.erase({ i, i });
+    EXPECT_TRUE(heap.empty());
+
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> elements;
+    for (std::uint64_t i = 0; i < 100; ++i)
+        elements.push_back({ 1000 - i, i });
+    heap.assign(elements.begin(), elements.end());
+    EXPECT_EQ(elements.size(), heap.size());
+
+    std::sort(elements.begin(), elements.end());
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> sorted;
+    while (!heap.empty())
+        sorted.push_back(heap.remove_min());
+    EXPECT_EQ(elements, sorted);
+}
+
+TEST(heap, reopen)
+{
+    fs::remove_all("storage_reopen");
+
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::int64_t> distribution(1, 1000);
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> elements;
+    {
+        data::heap<std::uint64_t, std::uint64_t> heap(5, "storage_reopen");
+        for (std::size_t i = 0; i < 1000; ++i)
+        {
+            std::uint64_t x = distribution(generator);
+            heap.add(x, x);
+            elements.push_back({x, x});
+        }
+        std::sort(elements.begin(), elements.end());
+        for (std::size_t i = 0; i < 100; ++i)
+            EXPECT_EQ(heap.remove_min(), elements[i]);
+        elements.erase(elements.begin(), elements.begin() + 100);
+    }
+
+    auto heap = data::heap<std::uint64_t, std::uint64_t>::open("storage_reopen");
+    EXPECT_EQ(heap->size(), elements.size());
+
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> sorted;
+    while (!heap->empty())
+        sorted.push_back(heap->remove_min());
+    EXPECT_EQ(elements, sorted);
+}
+
+TEST(heap, meld)
+{
+    fs::remove_all("storage_meld_1");
+    fs::remove_all("storage_meld_2");
+
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::int64_t> distribution(1, 1000);
+    data::heap<std::uint64_t, std::uint64_t> heap1(5, "storage_meld_1"), heap2(5, "storage_meld_2");
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> elements;
+    for (std::size_t i = 0; i < 500; ++i)
+    {
+        std::uint64_t x = distribution(generator);
+        heap1.add(x, x);
+        elements.push_back({x, x});
+    }
+    for (std::size_t i = 0; i < 200; ++i)
+    {
+        std::uint64_t x = distribution(generator) / 2;
+        heap2.add(x, x);
+        elements.push_back({x, x});
+    }
+
+    heap1.meld(heap2);
+    EXPECT_TRUE(heap2.empty());
+    EXPECT_EQ(heap1.size(), elements.size());
+
+    std::sort(elements.begin(), elements.end());
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> sorted;
+    while (!heap1.empty())
+        sorted.push_back(heap1.remove_min());
+    EXPECT_EQ(elements, sorted);
+}
+
+TEST(heap, memory_storage)
+{
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::int64_t> distribution(1, 1000);
+    storage::memory<std::string> storage;
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> elements;
+    {
+        data::heap<std::uint64_t, std::uint64_t> heap(storage, 4, 16);
+        for (std::size_t i = 0; i < 2000; ++i)
+        {
+            std::uint64_t x = distribution(generator);
+            heap.add(x, x);
+            elements.push_back({x, x});
+        }
+    }
+
+    auto heap = data::heap<std::uint64_t, std::uint64_t>::open(storage, 16);
+    EXPECT_EQ(heap->size(), elements.size());
+
+    std::sort(elements.begin(), elements.end());
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> sorted;
+    while (!heap->empty())
+        sorted.push_back(heap->remove_min());
+    EXPECT_EQ(elements, sorted);
+}
+
+TEST(heap, decrease_key)
+{
+    // Dijkstra's algorithm on random graph, every vertex is in the heap at most once
+    std::size_t n = 2000;
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::size_t> vertex(0, n - 1);
+    std::uniform_int_distribution<std::uint64_t> weight(1, 100);
+    std::vector<std::vector<std::pair<std::size_t, std::uint64_t>>> edges(n);
+    for (std::size_t i = 0; i < 10 * n; ++i)
+        edges[vertex(generator)].push_back({vertex(generator), weight(generator)});
+
+    const std::uint64_t infinity = std::numeric_limits<std::uint64_t>::max();
+    std::vector<std::uint64_t> expected(n, infinity);
+    {
+        std::set<std::pair<std::uint64_t, std::size_t>> queue{{0, 0}};
+        expected[0] = 0;
+        while (!queue.empty())
+        {
+            auto x = *queue.begin();
+            queue.erase(queue.begin());
+            for (auto & e : edges[x.second])
+                if (x.first + e.second < expected[e.first])
+                {
+                    queue.erase({expected[e.first], e.first});
+                    expected[e.first] = x.first + e.second;
+                    queue.insert({expected[e.first], e.first});
+                }
+        }
+    }
+
+    storage::memory<std::string> storage;
+    data::heap<std::uint64_t, std::uint64_t> heap(storage, 4);
+    std::vector<std::uint64_t> distance(n, infinity);
+    std::vector<bool> done(n, false);
+    distance[0] = 0;
+    heap.add(0, 0);
+    std::size_t removed = 0;
+    while (!heap.empty())
+    {
+        auto x = heap.remove_min();
+        ++removed;
+        EXPECT_FALSE(done[x.second]);
+        done[x.second] = true;
+        for (auto & e : edges[x.second])
+        {
+            std::uint64_t d = x.first + e.second;
+            if (done[e.first] || d >= distance[e.first])
+                continue;
+
+            if (distance[e.first] == infinity)
+                heap.add(d, e.first);
+            else
+                heap.decrease_key({distance[e.first], e.first}, d);
+            distance[e.first] = d;
+        }
+    }
+
+    EXPECT_EQ(expected, distance);
+    EXPECT_EQ(removed, std::count(done.begin(), done.end(), true));
+}
+
+TEST(heap, remove_max)
+{
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::uint64_t> distribution(1, 1000);
+    storage::memory<std::string> storage;
+    data::heap<std::uint64_t, std::uint64_t> heap(storage, 4);
+    std::multiset<std::pair<std::uint64_t, std::uint64_t>> expected;
+
+    // Elements with equal keys can be removed in any order
+    auto check = [&expected] (std::pair<std::uint64_t, std::uint64_t> x, std::uint64_t key)
+    {
+        EXPECT_EQ(x.first, key);
+        auto it = expected.find(x);
+        ASSERT_TRUE(it != expected.end());
+        expected.erase(it);
+    };
+
+    for (std::size_t i = 0; i < 20000; ++i)
+    {
+        auto r = generator() % 8;
+        if (r < 5 || expected.empty())
+        {
+            auto x = distribution(generator);
+            heap.add(x, i);
+            expected.insert({x, i});
+        }
+        else if (r < 6)
+            check(heap.remove_min(), expected.begin()->first);
+        else
+        {
+            // Heap is trimmed from the top
+            EXPECT_EQ(heap.max().first, expected.rbegin()->first);
+            check(heap.remove_max(), expected.rbegin()->first);
+        }
+        ASSERT_EQ(heap.size(), expected.size());
+    }
+
+    while (!expected.empty())
+        check(heap.remove_max(), expected.rbegin()->first);
+    EXPECT_TRUE(heap.empty());
+}
+
+TEST(heap, memory_budget)
+{
+    data::heap_stats stats[2];
+    for (bool budget : { false, true })
+    {
+        std::default_random_engine generator;
+        std::uniform_int_distribution<std::uint64_t> distribution(1, 1000000);
+        storage::memory<std::string> storage;
+        data::heap<std::uint64_t, std::uint64_t> heap(storage, 4);
+        if (budget)
+            heap.set_memory_budget(64 * 1024);
+
+        // Bursts of adds followed by bursts of removes
+        std::multiset<std::uint64_t> expected;
+        for (std::size_t burst = 0; burst < 10; ++burst)
+        {
+            for (std::size_t i = 0; i < 2000; ++i)
+            {
+                auto x = distribution(generator);
+                heap.add(x, x);
+                expected.insert(x);
+            }
+            for (std::size_t i = 0; i < 1500; ++i)
+            {
+                EXPECT_EQ(heap.remove_min().first, *expected.begin());
+                expected.erase(expected.begin());
+            }
+        }
+        EXPECT_EQ(heap.size(), expected.size());
+        stats[budget] = heap.statistics();
+    }
+
+    EXPECT_GT(stats[false].refills, 0);
+    EXPECT_LT(stats[true].refills, stats[false].refills);
+    EXPECT_LT(stats[true].spills, stats[false].spills);
+}
+
+TEST(heap, trace)
+{
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::uint64_t> distribution(1, 1000);
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> elements;
+    for (std::uint64_t i = 0; i < 500; ++i)
+        elements.push_back({distribution(generator), i});
+
+    std::stringstream recorded;
+    data::trace_writer trace(recorded);
+    storage::memory<std::string> storage;
+    data::heap<std::uint64_t, std::uint64_t> heap(storage, 3);
+    heap.set_trace(&trace);
+    heap.assign(elements.begin(), elements.end(), 64);
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> removed;
+    for (std::uint64_t i = 500; i < 1500; ++i)
+    {
+        auto h = heap.add(distribution(generator), i);
+        if (i % 7 == 0)
+            heap.decrease_key(h, h.first / 2);
+        if (i % 5 == 0)
+            heap.remove_min();
+        if (i % 11 == 0)
+            heap.remove_max();
+        if (i % 100 == 0)
+        {
+            heap.remove_min(10, std::back_inserter(removed));
+            trace.mark();
+        }
+    }
+    heap.set_trace(nullptr);
+    heap.add(0, 0);
+    heap.remove_min();
+
+    // Replay gives the same heap
+    {
+        std::stringstream in(recorded.str());
+        data::trace_reader reader(in);
+        storage::memory<std::string> replay_storage;
+        data::heap<std::uint64_t, std::uint64_t> replayed(replay_storage, 3);
+        auto stats = data::replay(reader, replayed);
+        EXPECT_EQ(0, stats.skipped);
+        EXPECT_EQ(10, stats.marks);
+        EXPECT_EQ(1 + 1000 + 200 + 2 * 143 + 91 + 10 + 10, stats.operations);
+
+        ASSERT_EQ(heap.size(), replayed.size());
+        while (!heap.empty())
+            EXPECT_EQ(heap.remove_min().first, replayed.remove_min().first);
+    }
+
+    // Engines without erase and remove_max skip them
+    {
+        std::stringstream in(recorded.str());
+        data::trace_reader reader(in);
+        storage::memory<std::string> replay_storage;
+        data::sequence_heap<std::uint64_t, std::uint64_t> replayed(replay_storage, 3);
+        auto stats = data::replay(reader, replayed);
+        EXPECT_EQ(143 + 91, stats.skipped);
+    }
+
+    // Assign replaces elements of engines without assign too
+    {
+        std::stringstream assigned;
+        data::trace_writer assign_trace(assigned);
+        storage::memory<std::string> recorded_storage;
+        data::heap<std::uint64_t, std::uint64_t> recorded_heap(recorded_storage, 3);
+        recorded_heap.set_trace(&assign_trace);
+        for (std::uint64_t i = 0; i < 100; ++i)
+            recorded_heap.add(i, i);
+        recorded_heap.assign(elements.begin(), elements.end());
+        recorded_heap.set_trace(nullptr);
+
+        std::stringstream in(assigned.str());
+        data::trace_reader reader(in);
+        storage::memory<std::string> replay_storage;
+        data::sequence_heap<std::uint64_t, std::uint64_t> replayed(replay_storage, 3);
+        data::replay(reader, replayed);
+        ASSERT_EQ(recorded_heap.size(), replayed.size());
+        while (!recorded_heap.empty())
+            EXPECT_EQ(recorded_heap.remove_min().first, replayed.remove_min().first);
+    }
+}
+
+// Engines with the heap interface, with small nodes and buffers in memory storage
+template <typename Heap>
+struct engine : testing::Test
+{
+    storage::memory<std::string> storage;
+};
+
+std::unique_ptr<data::heap<std::uint64_t, std::uint64_t>>
+make_heap(storage::memory<std::string> & storage, data::heap<std::uint64_t, std::uint64_t> *)
+{
+    return std::unique_ptr<data::heap<std::uint64_t, std::uint64_t>>(
+            new data::heap<std::uint64_t, std::uint64_t>(storage, 3));
+}
+
+std::unique_ptr<data::sequence_heap<std::uint64_t, std::uint64_t>>
+make_heap(storage::memory<std::string> & storage, data::sequence_heap<std::uint64_t, std::uint64_t> *)
+{
+    return std::unique_ptr<data::sequence_heap<std::uint64_t, std::uint64_t>>(
+            new data::sequence_heap<std::uint64_t, std::uint64_t>(storage, 2, 8, 1));
+}
+
+using engines = testing::Types<data::heap<std::uint64_t, std::uint64_t>,
+                               data::sequence_heap<std::uint64_t, std::uint64_t>>;
+TYPED_TEST_SUITE(engine, engines);
+
+TYPED_TEST(engine, random)
+{
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::uint64_t> distribution(1, 1000);
+    auto heap = make_heap(this->storage, static_cast<TypeParam *>(nullptr));
+    std::multiset<std::pair<std::uint64_t, std::uint64_t>> expected;
+    for (std::uint64_t i = 0; i < 5000; ++i)
+    {
+        // Adds are more frequent at first, removals later
+        if (expected.empty() || distribution(generator) > i / 5)
+        {
+            std::uint64_t x = distribution(generator);
+            heap->add(x, i);
+            expected.insert({x, i});
+        }
+        else
+        {
+            // Elements with equal keys can be removed in any order
+            auto x = heap->remove_min();
+            EXPECT_EQ(expected.begin()->first, x.first);
+            EXPECT_EQ(1, expected.erase(x));
+        }
+        EXPECT_EQ(expected.size(), heap->size());
+    }
+
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> rest;
+    for (std::size_t k : { 1, 7, 100, 0 })
+        heap->remove_min(k, std::back_inserter(rest));
+    while (!heap->empty())
+        rest.push_back(heap->remove_min());
+    ASSERT_EQ(expected.size(), rest.size());
+    auto it = expected.begin();
+    for (std::size_t i = 0; i < rest.size(); ++i, ++it)
+        EXPECT_EQ(it->first, rest[i].first);
+}
+
+TEST(radix_heap, hold)
+{
+    // Removed element is replaced by a bigger one, as in a discrete event simulation
+    std::default_random_engine generator;
+    std::uniform_int_distribution<std::uint64_t> distribution(0, 1000);
+    storage::memory<std::string> storage;
+    data::monotone_heap<std::uint64_t, std::uint64_t> heap(storage, 4);
+    std::multiset<std::pair<std::uint64_t, std::uint64_t>> expected;
+    for (std::uint64_t i = 0; i < 2000; ++i)
+    {
+        std::uint64_t x = distribution(generator);
+        heap.add(x, i);
+        expected.insert({x, i});
+    }
+
+    for (std::uint64_t i = 0; i < 10000; ++i)
+    {
+        auto x = heap.remove_min();
+        EXPECT_EQ(expected.begin()->first, x.first);
+        EXPECT_EQ(1, expected.erase(x));
+        if (i % 10 != 0)
+        {
+            std::uint64_t y = x.first + distribution(generator) * distribution(generator);
+            heap.add(y, i);
+            expected.insert({y, i});
+        }
+    }
+    EXPECT_EQ(expected.size(), heap.size());
+
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> rest;
+    heap.remove_min(expected.size() + 1, std::back_inserter(rest));
+    EXPECT_TRUE(heap.empty());
+    for (std::size_t i = 0; i + 1 < rest.size(); ++i)
+        EXPECT_LE(rest[i].first, rest[i + 1].first);
+
+    heap.add(rest.back().first, 0);
+    EXPECT_THROW(heap.add(rest.back().first - 1, 0), std::invalid_argument);
+}
+
+TEST(concurrent_heap, strict)
+{
+    storage::memory<std::string> storage;
+    data::concurrent_heap<std::uint64_t, std::uint64_t> heap(storage, 4, 4, 8);
+    std::size_t threads_count = 4, size = 2000;
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < threads_count; ++i)
+        threads.emplace_back([&heap, i, size] ()
+        {
+            std::default_random_engine generator(i);
+            std::uniform_int_distribution<std::uint64_t> distribution(1, 1000);
+            for (std::size_t j = 0; j < size; ++j)
+            {
+                auto x = distribution(generator);
+                heap.add(x, j);
+            }
+        });
+    for (auto & thread : threads)
+        thread.join();
+    EXPECT_EQ(heap.size(), threads_count * size);
+
+    // Single consumer sees strictly ascending order
+    std::uint64_t last = 0;
+    std::size_t count = 0;
+    while (auto x = heap.try_remove_min())
+    {
+        EXPECT_LE(last, x->first);
+        last = x->first;
+        ++count;
+    }
+    EXPECT_EQ(count, threads_count * size);
+    EXPECT_TRUE(heap.empty());
+}
+
+TEST(concurrent_heap, relaxed)
+{
+    storage::memory<std::string> storage;
+    data::concurrent_heap<std::uint64_t, std::uint64_t> heap(storage, 4, 8, 8);
+    std::size_t threads_count = 4, size = 2000;
+
+    // Producers and consumers work at the same time, every element is removed once
+    std::vector<std::vector<std::uint64_t>> removed(threads_count);
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < threads_count; ++i)
+        threads.emplace_back([&heap, &removed, i, size, threads_count] ()
+        {
+            std::default_random_engine generator(i);
+            std::uniform_int_distribution<std::uint64_t> distribution(1, 1000);
+            for (std::size_t j = 0; j < size; ++j)
+            {
+                heap.add(distribution(generator), i * size + j);
+                if (j % 2 == 0)
+                    if (auto x = heap.try_remove_min_relaxed())
+                        removed[i].push_back(x->second);
+            }
+        });
+    for (auto & thread : threads)
+        thread.join();
+    while (auto x = heap.try_remove_min_relaxed())
+        removed[0].push_back(x->second);
+
+    std::vector<std::uint64_t> all;
+    for (auto & r : removed)
+        all.insert(all.end(), r.begin(), r.end());
+    std::sort(all.begin(), all.end());
+    std::vector<std::uint64_t> expected(threads_count * size);
+    for (std::size_t i = 0; i < expected.size(); ++i)
+        expected[i] = i;
+    EXPECT_EQ(all, expected);
+}
+
+TEST(latency_histogram, percentiles)
+{
+    utils::latency_histogram h;
+    EXPECT_EQ(h.percentile(50), 0u);
+    for (std::uint64_t i = 1; i <= 1000; ++i)
+        h.record(i * 1000);
+
+    EXPECT_EQ(h.count(), 1000u);
+    EXPECT_EQ(h.min(), 1000u);
+    EXPECT_EQ(h.max(), 1000000u);
+    EXPECT_DOUBLE_EQ(h.mean(), 500500);
+    // Values are kept with relative error below 1/32
+    for (double p : { 1.0, 50.0, 90.0, 99.0, 99.9 })
+    {
+        double exact = p * 10 * 1000;
+        EXPECT_GE(double(h.percentile(p)), exact);
+        EXPECT_LE(double(h.percentile(p)), exact * (1 + 1.0 / 32));
+    }
+    EXPECT_EQ(h.percentile(100), 1000000u);
+
+    utils::latency_histogram other;
+    other.record(5);
+    other.record(std::numeric_limits<std::uint64_t>::max());
+    h.merge(other);
+    EXPECT_EQ(h.count(), 1002u);
+    EXPECT_EQ(h.min(), 5u);
+    EXPECT_EQ(h.percentile(0.05), 5u);
+    EXPECT_EQ(h.percentile(100), std::numeric_limits<std::uint64_t>::max());
+}
+
+// test_heap is built with HEAP_PROBES
+TEST(heap, probes)
+{
+    std::map<utils::probe_event, std::size_t> begins, ends;
+    std::size_t depth = 0, max_depth = 0;
+    utils::probe_hooks hooks;
+    hooks.begin = [&] (utils::probe_event e)
+    {
+        ++begins[e];
+        max_depth = std::max(max_depth, ++depth);
+    };
+    hooks.end = [&] (utils::probe_event e, std::chrono::nanoseconds)
+    {
+        ++ends[e];
+        --depth;
+    };
+    utils::set_probe_hooks(hooks);
+    utils::reset_probe_histograms();
+
+    {
+        storage::memory<std::string> mem;
+        data::heap<std::uint64_t, std::uint64_t> heap(mem, 3);
+        std::mt19937 generator;
+        for (std::size_t i = 0; i < 2000; ++i)
+            heap.add(generator() % 1000, i);
+        while (!heap.empty())
+            heap.remove_min();
+    }
+    utils::set_probe_hooks(utils::probe_hooks());
+
+    EXPECT_EQ(depth, 0u);
+    EXPECT_GT(max_depth, 2u);
+    EXPECT_EQ(begins, ends);
+    EXPECT_EQ(utils::probe_histogram(utils::probe_event::heap_add).count(), 2000u);
+    EXPECT_EQ(utils::probe_histogram(utils::probe_event::heap_remove_min).count(), 2000u);
+    for (auto e : { utils::probe_event::flush, utils::probe_event::split, utils::probe_event::merge,
+                    utils::probe_event::refill, utils::probe_event::spill })
+    {
+        EXPECT_GT(utils::probe_histogram(e).count(), 0u) << utils::probe_name(e);
+        EXPECT_EQ(utils::probe_histogram(e).count(), begins[e]) << utils::probe_name(e);
+    }
+    // Buffers are flushed when they have at least t pending elements
+    auto flushes = utils::probe_size_histogram(utils::probe_event::flush);
+    EXPECT_EQ(flushes.count(), begins[utils::probe_event::flush]);
+    EXPECT_GE(flushes.max(), 3u);
+    EXPECT_EQ(utils::probe_size_histogram(utils::probe_event::spill).count(), begins[utils::probe_event::spill]);
+    EXPECT_EQ(utils::probe_size_histogram(utils::probe_event::heap_add).count(), 0u);
+    EXPECT_LE(utils::probe_histogram(utils::probe_event::heap_add).percentile(50),
+              utils::probe_histogram(utils::probe_event::heap_add).max());
+
+    utils::reset_probe_histograms();
+    EXPECT_EQ(utils::probe_histogram(utils::probe_event::heap_add).count(), 0u);
+}
+
 int main(int argc, char ** argv)
 {
     testing::InitGoogleTest(&argc, argv);
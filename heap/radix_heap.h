@@ -0,0 +1,223 @@
+#pragma once
+
+#include "heap.h"
+
+#include <btree/serialize.h>
+#include <storage/directory.h>
+
+#include <vector>
+#include <array>
+#include <memory>
+#include <utility>
+#include <limits>
+#include <type_traits>
+#include <functional>
+#include <stdexcept>
+
+namespace data
+{
+// External radix heap for monotone integer keys: added key should not be less
+// than the last removed one
+// Element goes to bucket i + 1, where i is the highest bit in which its key differs
+// from the last removed key (bucket 0 keeps keys equal to it). Every bucket is an
+// append-only run of chunks of 2 * t - 1 elements in the storage plus one chunk in memory.
+// When bucket 0 is empty, the first nonempty bucket is read chunk by chunk and
+// redistributed to lower buckets around its minimal key, so every element is
+// written at most once per bit of the key.
+template <typename Key, typename Value, typename Serialized = std::string>
+struct radix_heap
+{
+    static_assert(std::is_integral<Key>::value && sizeof(Key) <= sizeof(unsigned long long),
+                  "Radix heap needs integer keys");
+
+    using serializer_t = std::function<Serialized *(detail::b_node_data<Key, Value> *)>;
+    using deserializer_t = std::function<detail::b_node_data<Key, Value> *(Serialized *)>;
+
+    radix_heap(std::size_t t, const fs::path & path = "storage")
+        : radix_heap(std::unique_ptr<storage::basic_storage<Serialized>>(new storage::directory<Serialized>(path)),
+                     t, bptree::serialize, bptree::deserialize)
+    {}
+
+    // Heap in the storage owned by the caller, storage should outlive the heap
+    radix_heap(storage::basic_storage<Serialized> & storage,
+               std::size_t t,
+               serializer_t serializer = bptree::serialize,
+               deserializer_t deserializer = bptree::deserialize)
+        : radix_heap(nullptr, storage, t, serializer, deserializer)
+    {}
+
+    radix_heap(const radix_heap & other) = delete;
+
+    // Heap is not persistent, its runs are deleted
+    ~radix_heap()
+    {
+        for (auto & b : buckets)
+            for (auto id : b.chunks)
+                storage.delete_node(id);
+    }
+
+    void add(Key k, Value v)
+    {
+        if (radix(k) < last)
+            throw std::invalid_argument("Trying to add key less than the last removed one to radix heap");
+        push(k, v);
+    }
+
+    std::pair<Key, Value> remove_min()
+    {
+        if (empty())
+            throw std::runtime_error("Trying to remove minimal element from empty heap");
+        if (buckets[0].size == 0)
+            redistribute();
+
+        bucket & b = buckets[0];
+        if (b.buffer.empty())
+        {
+            b.buffer = load(b.chunks.back());
+            b.chunks.pop_back();
+        }
+        auto result = b.buffer.back();
+        b.buffer.pop_back();
+        --b.size;
+        --size_;
+        return result;
+    }
+
+    // Move up to k minimal elements to out in ascending order
+    template <typename OutIter>
+    OutIter remove_min(std::size_t k, OutIter out)
+    {
+        for (; k > 0 && !empty(); --k)
+        {
+            *out = remove_min();
+            ++out;
+        }
+        return out;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+private:
+    using radix_t = typename std::make_unsigned<Key>::type;
+    static constexpr std::size_t bits = std::numeric_limits<radix_t>::digits;
+
+    struct bucket
+    {
+        // Chunks of the run, the last one is written when it gets full
+        std::vector<storage::node_id> chunks;
+        std::vector<std::pair<Key, Value>> buffer;
+        std::size_t size = 0;
+        radix_t min = std::numeric_limits<radix_t>::max();
+    };
+
+    radix_heap(std::unique_ptr<storage::basic_storage<Serialized>> && owned,
+               std::size_t t,
+               serializer_t serializer,
+               deserializer_t deserializer)
+        : radix_heap(std::move(owned), *owned, t, serializer, deserializer)
+    {}
+
+    radix_heap(std::unique_ptr<storage::basic_storage<Serialized>> && owned,
+               storage::basic_storage<Serialized> & storage,
+               std::size_t t,
+               serializer_t serializer,
+               deserializer_t deserializer)
+        : chunk_size(2 * t - 1)
+        , last(0)
+        , size_(0)
+        , owned_storage(std::move(owned))
+        , storage(storage)
+        , serializer(serializer)
+        , deserializer(deserializer)
+    {}
+
+    // Keys are compared as unsigned numbers, sign bit of signed keys is flipped
+    // so that negative keys come first
+    static radix_t radix(Key k)
+    {
+        return radix_t(k) ^ (std::is_signed<Key>::value ? radix_t(1) << (bits - 1) : 0);
+    }
+
+    std::size_t bucket_index(radix_t r) const
+    {
+        radix_t diff = r ^ last;
+        if (diff == 0)
+            return 0;
+        return std::numeric_limits<unsigned long long>::digits - __builtin_clzll(diff);
+    }
+
+    void push(Key k, Value v)
+    {
+        radix_t r = radix(k);
+        bucket & b = buckets[bucket_index(r)];
+        b.buffer.push_back({ k, v });
+        ++b.size;
+        ++size_;
+        if (r < b.min)
+            b.min = r;
+
+        if (b.buffer.size() >= chunk_size)
+        {
+            storage::node_id id = storage.new_node();
+            detail::b_leaf_data<Key, Value> chunk(id, boost::none, 0, b.buffer);
+            std::unique_ptr<Serialized> serialized(serializer(&chunk));
+            storage.write_node(id, serialized.get());
+            b.chunks.push_back(id);
+            b.buffer.clear();
+        }
+    }
+
+    // Read chunk and delete it from the storage
+    std::vector<std::pair<Key, Value>> load(storage::node_id id)
+    {
+        std::shared_ptr<Serialized> serialized = storage.load_node(id);
+        std::unique_ptr<detail::b_node_data<Key, Value>> chunk(deserializer(serialized.get()));
+        storage.delete_node(id);
+        return std::move(dynamic_cast<detail::b_leaf_data<Key, Value> &>(*chunk).values_);
+    }
+
+    // Make the minimal key of the first nonempty bucket the last removed key
+    // and move elements of this bucket to lower buckets
+    void redistribute()
+    {
+        std::size_t i = 1;
+        while (buckets[i].size == 0)
+            ++i;
+
+        bucket source;
+        std::swap(source, buckets[i]);
+        last = source.min;
+        size_ -= source.size;
+
+        for (auto id : source.chunks)
+            for (auto & x : load(id))
+                push(x.first, x.second);
+        for (auto & x : source.buffer)
+            push(x.first, x.second);
+    }
+
+    std::size_t chunk_size;
+    radix_t last;
+    std::size_t size_;
+    std::array<bucket, bits + 1> buckets;
+    std::unique_ptr<storage::basic_storage<Serialized>> owned_storage;
+    storage::basic_storage<Serialized> & storage;
+    serializer_t serializer;
+    deserializer_t deserializer;
+};
+
+// Heap engine chosen at compile time: radix heap for integer keys, buffer tree heap otherwise
+// Both are constructed with (t, path) or (storage, t), radix heap needs monotone keys
+template <typename Key, typename Value, typename Serialized = std::string>
+using monotone_heap = typename std::conditional<std::is_integral<Key>::value,
+                                                radix_heap<Key, Value, Serialized>,
+                                                heap<Key, Value, Serialized>>::type;
+}
@@ -0,0 +1,262 @@
+#pragma once
+
+#include "heap.h"
+
+#include <btree/serialize.h>
+#include <storage/directory.h>
+
+#include <vector>
+#include <map>
+#include <set>
+#include <queue>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+namespace data
+{
+// Sequence heap (Sanders): new elements go to a binary insertion heap, which is
+// sorted into a sequence of group 0 when it is full. Group i keeps up to k = 2 * t
+// sorted sequences, a full group is merged into one sequence of group i + 1.
+// Sequences of the first memory_groups groups are kept in memory, others are written
+// to the storage as runs of chunks of 2 * t - 1 elements. The minimal element is
+// the smaller of the insertion heap top and the minimal head of all sequences.
+template <typename Key, typename Value, typename Serialized = std::string>
+struct sequence_heap
+{
+    using serializer_t = std::function<Serialized *(detail::b_node_data<Key, Value> *)>;
+    using deserializer_t = std::function<detail::b_node_data<Key, Value> *(Serialized *)>;
+
+    static constexpr std::size_t default_insertion_size = 1024;
+    static constexpr std::size_t default_memory_groups = 2;
+
+    sequence_heap(std::size_t t, const fs::path & path = "storage",
+                  std::size_t insertion_size = default_insertion_size,
+                  std::size_t memory_groups = default_memory_groups)
+        : sequence_heap(std::unique_ptr<storage::basic_storage<Serialized>>(new storage::directory<Serialized>(path)),
+                        t, insertion_size, memory_groups, bptree::serialize, bptree::deserialize)
+    {}
+
+    // Heap in the storage owned by the caller, storage should outlive the heap
+    sequence_heap(storage::basic_storage<Serialized> & storage,
+                  std::size_t t,
+                  std::size_t insertion_size = default_insertion_size,
+                  std::size_t memory_groups = default_memory_groups,
+                  serializer_t serializer = bptree::serialize,
+                  deserializer_t deserializer = bptree::deserialize)
+        : sequence_heap(nullptr, storage, t, insertion_size, memory_groups, serializer, deserializer)
+    {}
+
+    sequence_heap(const sequence_heap & other) = delete;
+
+    // Heap is not persistent, its runs are deleted
+    ~sequence_heap()
+    {
+        for (auto & s : sequences)
+            for (; !s.second.run.chunks.empty(); s.second.run.chunks.pop())
+                storage.delete_node(s.second.run.chunks.front());
+    }
+
+    void add(Key k, Value v)
+    {
+        if (insertion.size() == insertion_size)
+            flush_insertion();
+        insertion.push_back({ k, v });
+        std::push_heap(insertion.begin(), insertion.end(), std::greater<std::pair<Key, Value>>());
+        ++size_;
+    }
+
+    std::pair<Key, Value> remove_min()
+    {
+        if (empty())
+            throw std::runtime_error("Trying to remove minimal element from empty heap");
+        --size_;
+
+        if (!insertion.empty() && (heads.empty() || insertion.front() < heads.begin()->first))
+        {
+            std::pop_heap(insertion.begin(), insertion.end(), std::greater<std::pair<Key, Value>>());
+            auto result = insertion.back();
+            insertion.pop_back();
+            return result;
+        }
+
+        std::size_t id = heads.begin()->second;
+        heads.erase(heads.begin());
+        sequence & s = sequences.at(id);
+        auto result = s.run.next(storage, deserializer);
+        if (s.run.empty())
+        {
+            auto & group = groups[s.group];
+            group.erase(std::find(group.begin(), group.end(), id));
+            sequences.erase(id);
+        }
+        else
+            heads.insert({ s.run.front(storage, deserializer), id });
+        return result;
+    }
+
+    // Move up to k minimal elements to out in ascending order
+    template <typename OutIter>
+    OutIter remove_min(std::size_t k, OutIter out)
+    {
+        for (; k > 0 && !empty(); --k)
+        {
+            *out = remove_min();
+            ++out;
+        }
+        return out;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+private:
+    using run_t = detail::run_reader<Key, Value>;
+
+    struct sequence
+    {
+        run_t run;
+        std::size_t group;
+    };
+
+    sequence_heap(std::unique_ptr<storage::basic_storage<Serialized>> && owned,
+                  std::size_t t,
+                  std::size_t insertion_size,
+                  std::size_t memory_groups,
+                  serializer_t serializer,
+                  deserializer_t deserializer)
+        : sequence_heap(std::move(owned), *owned, t, insertion_size, memory_groups, serializer, deserializer)
+    {}
+
+    sequence_heap(std::unique_ptr<storage::basic_storage<Serialized>> && owned,
+                  storage::basic_storage<Serialized> & storage,
+                  std::size_t t,
+                  std::size_t insertion_size,
+                  std::size_t memory_groups,
+                  serializer_t serializer,
+                  deserializer_t deserializer)
+        : merge_size(2 * t)
+        , chunk_size(2 * t - 1)
+        , insertion_size(std::max<std::size_t>(insertion_size, 1))
+        , memory_groups(memory_groups)
+        , size_(0)
+        , next_id(0)
+        , owned_storage(std::move(owned))
+        , storage(storage)
+        , serializer(serializer)
+        , deserializer(deserializer)
+    {}
+
+    void flush_insertion()
+    {
+        std::sort(insertion.begin(), insertion.end());
+        run_t run;
+        for (auto & x : insertion)
+            append(run, 0, x);
+        finish(run, 0);
+        insertion.clear();
+        add_sequence(0, std::move(run));
+    }
+
+    void add_sequence(std::size_t group, run_t && run)
+    {
+        if (groups.size() == group)
+            groups.emplace_back();
+        if (groups[group].size() == merge_size)
+            add_sequence(group + 1, merge_group(group));
+
+        std::size_t id = next_id++;
+        heads.insert({ run.front(storage, deserializer), id });
+        sequences[id] = sequence{ std::move(run), group };
+        groups[group].push_back(id);
+    }
+
+    // Merge all sequences of the group into one sequence of the next group
+    run_t merge_group(std::size_t group)
+    {
+        std::priority_queue<std::pair<std::pair<Key, Value>, std::size_t>,
+                std::vector<std::pair<std::pair<Key, Value>, std::size_t>>,
+                std::greater<std::pair<std::pair<Key, Value>, std::size_t>>> merge;
+        for (auto id : groups[group])
+        {
+            run_t & run = sequences.at(id).run;
+            const auto & head = run.front(storage, deserializer);
+            heads.erase({ head, id });
+            merge.push({ head, id });
+        }
+
+        run_t result;
+        while (!merge.empty())
+        {
+            auto x = merge.top();
+            merge.pop();
+            run_t & run = sequences.at(x.second).run;
+            append(result, group + 1, run.next(storage, deserializer));
+            if (!run.empty())
+                merge.push({ run.front(storage, deserializer), x.second });
+        }
+        finish(result, group + 1);
+
+        for (auto id : groups[group])
+            sequences.erase(id);
+        groups[group].clear();
+        return result;
+    }
+
+    bool external(std::size_t group) const
+    {
+        return group >= memory_groups;
+    }
+
+    // Sequences of external groups are written by chunks as they are built
+    void append(run_t & run, std::size_t group, const std::pair<Key, Value> & x)
+    {
+        run.values.push_back(x);
+        if (external(group) && run.values.size() == chunk_size)
+            write_chunk(run);
+    }
+
+    void finish(run_t & run, std::size_t group)
+    {
+        if (external(group) && !run.values.empty())
+            write_chunk(run);
+    }
+
+    void write_chunk(run_t & run)
+    {
+        storage::node_id id = storage.new_node();
+        detail::b_leaf_data<Key, Value> chunk(id, boost::none, 0, run.values);
+        std::unique_ptr<Serialized> serialized(serializer(&chunk));
+        storage.write_node(id, serialized.get());
+        run.chunks.push(id);
+        run.values.clear();
+    }
+
+    std::size_t merge_size;
+    std::size_t chunk_size;
+    std::size_t insertion_size;
+    std::size_t memory_groups;
+    std::size_t size_;
+    std::size_t next_id;
+    // Binary heap of minimal element at front
+    std::vector<std::pair<Key, Value>> insertion;
+    std::map<std::size_t, sequence> sequences;
+    // Ids of sequences of every group
+    std::vector<std::vector<std::size_t>> groups;
+    // Heads of all sequences with ids of sequences
+    std::set<std::pair<std::pair<Key, Value>, std::size_t>> heads;
+    std::unique_ptr<storage::basic_storage<Serialized>> owned_storage;
+    storage::basic_storage<Serialized> & storage;
+    serializer_t serializer;
+    deserializer_t deserializer;
+};
+}
@@ -0,0 +1,43 @@
+#include "serialize.h"
+
+#include <stdexcept>
+
+namespace data
+{
+std::string * serialize(const detail::heap_superblock<std::uint64_t, std::uint64_t> & superblock)
+{
+    btree::HeapSuperblock result;
+    if (superblock.root_)
+        result.set_root_id(*superblock.root_);
+    result.set_t(superblock.t_);
+    result.set_big_size(superblock.big_size_);
+    result.set_small_max(superblock.small_max_);
+    for (auto value : superblock.small_)
+    {
+        btree::KV * kv = result.add_small();
+        kv->set_key(value.first);
+        kv->set_value(value.second);
+    }
+
+    return new std::string(result.SerializeAsString());
+}
+
+detail::heap_superblock<std::uint64_t, std::uint64_t> deserialize_superblock(std::string * serialized)
+{
+    btree::HeapSuperblock superblock;
+    auto r = superblock.ParseFromString(*serialized);
+    if (!r)
+        throw std::runtime_error("Error deserializing heap superblock");
+
+    detail::heap_superblock<std::uint64_t, std::uint64_t> result;
+    if (superblock.has_root_id())
+        result.root_ = superblock.root_id();
+    result.t_ = superblock.t();
+    result.big_size_ = superblock.big_size();
+    result.small_max_ = superblock.small_max();
+    for (auto v : superblock.small())
+        result.small_.push_back({v.key(), v.value()});
+
+    return result;
+}
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "superblock.h"
+
+#include <btree/serialize/btree.pb.h>
+
+#include <string>
+
+namespace data
+{
+std::string * serialize(const detail::heap_superblock<std::uint64_t, std::uint64_t> & superblock);
+detail::heap_superblock<std::uint64_t, std::uint64_t> deserialize_superblock(std::string * serialized);
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <cstddef>
+
+namespace detail
+{
+// Sorted sequence of elements in a ring buffer
+// Minimal and maximal elements are removed in O(1), insertion searches
+// position by binary search and moves the shorter side of the sequence,
+// so all elements are kept in one contiguous allocation
+template <typename Key, typename Value>
+struct small_set
+{
+    using value_type = std::pair<Key, Value>;
+    using const_reference = const value_type &;
+
+    struct const_iterator
+    {
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = small_set::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type *;
+        using reference = const value_type &;
+
+        const_iterator(const small_set * set, std::size_t i)
+            : set(set)
+            , i(i)
+        {}
+
+        const value_type & operator*() const
+        {
+            return set->at(i);
+        }
+
+        const value_type * operator->() const
+        {
+            return &set->at(i);
+        }
+
+        const_iterator & operator++()
+        {
+            ++i;
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator result = *this;
+            ++i;
+            return result;
+        }
+
+        bool operator==(const const_iterator & other) const
+        {
+            return i == other.i;
+        }
+
+        bool operator!=(const const_iterator & other) const
+        {
+            return i != other.i;
+        }
+
+    private:
+        const small_set * set;
+        std::size_t i;
+    };
+
+    small_set(std::size_t capacity = 0)
+        : head(0)
+        , size_(0)
+    {
+        reserve(capacity);
+    }
+
+    template <typename It>
+    small_set(It first, It last)
+        : small_set()
+    {
+        for (; first != last; ++first)
+            push_back(*first);
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    const value_type & front() const
+    {
+        return at(0);
+    }
+
+    const value_type & back() const
+    {
+        return at(size_ - 1);
+    }
+
+    void pop_front()
+    {
+        head = (head + 1) & mask();
+        --size_;
+    }
+
+    void pop_back()
+    {
+        --size_;
+    }
+
+    void clear()
+    {
+        head = 0;
+        size_ = 0;
+    }
+
+    // Element should not be less than the current maximal element
+    void push_back(const value_type & x)
+    {
+        reserve(size_ + 1);
+        at(size_) = x;
+        ++size_;
+    }
+
+    void insert(value_type x)
+    {
+        reserve(size_ + 1);
+        std::size_t pos = lower_bound(x);
+
+        if (pos < size_ / 2)
+        {
+            // Move first pos elements one step left
+            head = (head - 1) & mask();
+            for (std::size_t i = 0; i < pos; ++i)
+                at(i) = std::move(at(i + 1));
+        }
+        else
+        {
+            // Move elements after pos one step right
+            for (std::size_t i = size_; i > pos; --i)
+                at(i) = std::move(at(i - 1));
+        }
+        at(pos) = std::move(x);
+        ++size_;
+    }
+
+    // Remove element equal to x, return false if there is none
+    bool erase(const value_type & x)
+    {
+        std::size_t pos = lower_bound(x);
+        if (pos == size_ || !(at(pos) == x))
+            return false;
+
+        if (pos < size_ / 2)
+        {
+            // Move first pos elements one step right
+            for (std::size_t i = pos; i > 0; --i)
+                at(i) = std::move(at(i - 1));
+            head = (head + 1) & mask();
+        }
+        else
+        {
+            // Move elements after pos one step left
+            for (std::size_t i = pos; i + 1 < size_; ++i)
+                at(i) = std::move(at(i + 1));
+        }
+        --size_;
+        return true;
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, size_);
+    }
+
+private:
+    // Branchless binary search of the first element not less than x
+    std::size_t lower_bound(const value_type & x) const
+    {
+        std::size_t pos = 0;
+        if (size_ > 0)
+        {
+            std::size_t len = size_;
+            while (len > 1)
+            {
+                std::size_t half = len / 2;
+                pos = at(pos + half) < x ? pos + half : pos;
+                len -= half;
+            }
+            pos += at(pos) < x ? 1 : 0;
+        }
+
+        return pos;
+    }
+
+    std::size_t mask() const
+    {
+        return data.size() - 1;
+    }
+
+    value_type & at(std::size_t i)
+    {
+        return data[(head + i) & mask()];
+    }
+
+    const value_type & at(std::size_t i) const
+    {
+        return data[(head + i) & mask()];
+    }
+
+    // Capacity is kept a power of two
+    void reserve(std::size_t capacity)
+    {
+        if (capacity <= data.size() && !data.empty())
+            return;
+
+        std::size_t new_capacity = data.empty() ? 1 : data.size();
+        while (new_capacity < capacity)
+            new_capacity *= 2;
+
+        std::vector<value_type> new_data(new_capacity);
+        for (std::size_t i = 0; i < size_; ++i)
+            new_data[i] = std::move(at(i));
+        data.swap(new_data);
+        head = 0;
+    }
+
+    std::vector<value_type> data;
+    std::size_t head;
+    std::size_t size_;
+};
+}
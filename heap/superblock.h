@@ -0,0 +1,21 @@
+#pragma once
+
+#include <storage/node_id.h>
+
+#include <boost/optional.hpp>
+#include <vector>
+#include <utility>
+
+namespace detail
+{
+// Everything except tree nodes that is needed to reopen the heap
+template <typename Key, typename Value>
+struct heap_superblock
+{
+    boost::optional<storage::node_id> root_;
+    std::size_t t_;
+    std::size_t big_size_;
+    Key small_max_;
+    std::vector<std::pair<Key, Value>> small_;
+};
+}
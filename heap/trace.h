@@ -0,0 +1,326 @@
+#pragma once
+
+#include <istream>
+#include <ostream>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <algorithm>
+
+namespace detail
+{
+constexpr char trace_magic[] = "HEAPTRC1";
+}
+
+namespace data
+{
+enum class trace_op : std::uint8_t
+{
+    add = 1,
+    remove_min,
+    // Removal of count minimal elements at once
+    remove_min_batch,
+    erase,
+    remove_max,
+    // Element of the range given to assign
+    element,
+    // Replacement of heap contents by count preceding element events
+    assign,
+    // Boundary of a batch of operations marked by the caller
+    mark
+};
+
+struct trace_event
+{
+    trace_op op;
+    // Nanoseconds since the start of recording
+    std::uint64_t time = 0;
+    std::uint64_t key = 0;
+    std::uint64_t value = 0;
+    std::uint64_t count = 0;
+};
+
+// Heap operations written to a stream in compact binary form: header, then
+// for every operation its code, nanoseconds since the previous operation and
+// its arguments, all numbers are written as varints
+// Keys and values should be integers
+struct trace_writer
+{
+    trace_writer(std::ostream & out)
+        : out(out)
+        , last(std::chrono::steady_clock::now())
+    {
+        out.write(detail::trace_magic, sizeof(detail::trace_magic) - 1);
+    }
+
+    trace_writer(const trace_writer & other) = delete;
+
+    void add(std::uint64_t k, std::uint64_t v)
+    {
+        event(trace_op::add);
+        number(k);
+        number(v);
+    }
+
+    void remove_min()
+    {
+        event(trace_op::remove_min);
+    }
+
+    void remove_min(std::size_t count)
+    {
+        event(trace_op::remove_min_batch);
+        number(count);
+    }
+
+    void erase(std::uint64_t k, std::uint64_t v)
+    {
+        event(trace_op::erase);
+        number(k);
+        number(v);
+    }
+
+    void remove_max()
+    {
+        event(trace_op::remove_max);
+    }
+
+    void element(std::uint64_t k, std::uint64_t v)
+    {
+        event(trace_op::element);
+        number(k);
+        number(v);
+    }
+
+    void assign(std::size_t count)
+    {
+        event(trace_op::assign);
+        number(count);
+    }
+
+    void mark()
+    {
+        event(trace_op::mark);
+    }
+
+private:
+    void event(trace_op op)
+    {
+        auto now = std::chrono::steady_clock::now();
+        out.put(static_cast<char>(op));
+        number(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count());
+        last = now;
+    }
+
+    void number(std::uint64_t x)
+    {
+        while (x >= 0x80)
+        {
+            out.put(static_cast<char>(x | 0x80));
+            x >>= 7;
+        }
+        out.put(static_cast<char>(x));
+    }
+
+    std::ostream & out;
+    std::chrono::steady_clock::time_point last;
+};
+
+struct trace_reader
+{
+    trace_reader(std::istream & in)
+        : in(in)
+        , time(0)
+    {
+        char header[sizeof(detail::trace_magic) - 1];
+        if (!in.read(header, sizeof(header)) || !std::equal(header, header + sizeof(header), detail::trace_magic))
+            throw std::runtime_error("Not a heap trace");
+    }
+
+    // Read next event, return false at the end of the trace
+    bool next(trace_event & e)
+    {
+        int op = in.get();
+        if (op == std::char_traits<char>::eof())
+            return false;
+
+        e = trace_event();
+        e.op = static_cast<trace_op>(op);
+        time += number();
+        e.time = time;
+        switch (e.op)
+        {
+        case trace_op::add:
+        case trace_op::erase:
+        case trace_op::element:
+            e.key = number();
+            e.value = number();
+            break;
+        case trace_op::remove_min_batch:
+        case trace_op::assign:
+            e.count = number();
+            break;
+        case trace_op::remove_min:
+        case trace_op::remove_max:
+        case trace_op::mark:
+            break;
+        default:
+            throw std::runtime_error("Unknown trace operation " + std::to_string(op));
+        }
+        return true;
+    }
+
+private:
+    std::uint64_t number()
+    {
+        std::uint64_t x = 0;
+        for (int shift = 0; ; shift += 7)
+        {
+            int byte = in.get();
+            if (byte == std::char_traits<char>::eof())
+                throw std::runtime_error("Truncated heap trace");
+            x |= std::uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return x;
+        }
+    }
+
+    std::istream & in;
+    std::uint64_t time;
+};
+}
+
+namespace detail
+{
+// Operations that not every heap engine has are chosen by overload resolution:
+// the int overload exists only if the heap has the operation
+template <typename Heap>
+auto trace_erase(Heap & heap, const data::trace_event & e, int) -> decltype(heap.erase({ e.key, e.value }), bool())
+{
+    heap.erase({ e.key, e.value });
+    return true;
+}
+
+template <typename Heap>
+bool trace_erase(Heap &, const data::trace_event &, long)
+{
+    return false;
+}
+
+template <typename Heap>
+auto trace_remove_max(Heap & heap, int) -> decltype(heap.remove_max(), bool())
+{
+    heap.remove_max();
+    return true;
+}
+
+template <typename Heap>
+bool trace_remove_max(Heap &, long)
+{
+    return false;
+}
+
+template <typename Heap, typename Elements>
+auto trace_assign(Heap & heap, const Elements & elements, int)
+    -> decltype(heap.assign(elements.begin(), elements.end()), void())
+{
+    heap.assign(elements.begin(), elements.end());
+}
+
+template <typename Heap, typename Elements>
+void trace_assign(Heap & heap, const Elements & elements, long)
+{
+    while (!heap.empty())
+        heap.remove_min();
+    for (auto & x : elements)
+        heap.add(x.first, x.second);
+}
+}
+
+namespace data
+{
+struct replay_stats
+{
+    std::size_t operations = 0;
+    // Operations the heap engine doesn't have
+    std::size_t skipped = 0;
+    std::size_t marks = 0;
+    // Nanoseconds between the first and the last recorded events
+    std::uint64_t recorded_time = 0;
+};
+
+// Apply one operation other than assign, return false if the heap doesn't have it
+template <typename Heap>
+bool apply(Heap & heap, const trace_event & e, std::vector<std::pair<std::uint64_t, std::uint64_t>> & removed)
+{
+    switch (e.op)
+    {
+    case trace_op::add:
+        heap.add(e.key, e.value);
+        return true;
+    case trace_op::remove_min:
+        heap.remove_min();
+        return true;
+    case trace_op::remove_min_batch:
+        removed.clear();
+        heap.remove_min(e.count, std::back_inserter(removed));
+        return true;
+    case trace_op::erase:
+        return detail::trace_erase(heap, e, 0);
+    case trace_op::remove_max:
+        return detail::trace_remove_max(heap, 0);
+    case trace_op::mark:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Apply operations of the trace to the heap
+// Assign is replayed by heap's assign if it has one, otherwise the heap is emptied
+// by remove_min and the elements are added, so it holds what the recorded heap held
+template <typename Heap>
+replay_stats replay(trace_reader & reader, Heap & heap)
+{
+    replay_stats stats;
+    // Elements of the next assign
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> elements;
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> removed;
+    trace_event e;
+    bool first = true;
+    std::uint64_t start = 0;
+    while (reader.next(e))
+    {
+        if (first)
+            start = e.time;
+        first = false;
+        stats.recorded_time = e.time - start;
+
+        if (e.op == trace_op::element)
+        {
+            elements.push_back({ e.key, e.value });
+            continue;
+        }
+
+        if (e.op == trace_op::assign)
+        {
+            detail::trace_assign(heap, elements, 0);
+            elements.clear();
+        }
+        else if (!apply(heap, e, removed))
+        {
+            ++stats.skipped;
+            continue;
+        }
+
+        ++stats.operations;
+        if (e.op == trace_op::mark)
+            ++stats.marks;
+    }
+    return stats;
+}
+}
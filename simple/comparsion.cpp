@@ -1,11 +1,19 @@
 #include "heap.h"
+#include "paged_heap.h"
 
 #include <heap/heap.h>
+#include <heap/concurrent_heap.h>
+#include <heap/sequence_heap.h>
+#include <storage/memory.h>
+#include <storage/counting.h>
 #include <utils/undefined.h>
+#include <utils/thread_pool.h>
 
 #include <gtest/gtest.h>
 #include <chrono>
 #include <iostream>
+#include <random>
+#include <thread>
 
 TEST(comparsion, all)
 {
@@ -71,6 +79,202 @@ TEST(comparsion, all)
     EXPECT_EQ(heap_elements, simple_heap_elements);
 }
 
+TEST(comparsion, concurrent_add)
+{
+    std::size_t size = 20000;
+    std::size_t max_threads = std::max<std::size_t>(4, 2 * std::thread::hardware_concurrency());
+    std::cout << "Size: " << size << " elements" << std::endl;
+
+    for (std::size_t threads_count = 1; threads_count <= max_threads; threads_count *= 2)
+    {
+        storage::memory<std::string> mem;
+        bptree::b_tree<std::uint64_t, std::uint64_t> tree(mem, 16);
+
+        auto start = std::chrono::system_clock::now();
+        std::vector<std::thread> threads;
+        for (std::size_t i = 0; i < threads_count; ++i)
+            threads.emplace_back([&tree, i, size, threads_count] ()
+            {
+                std::mt19937 generator(i);
+                std::uniform_int_distribution<std::uint64_t> distribution(1, 1000000);
+                for (std::size_t j = 0; j < size / threads_count; ++j)
+                {
+                    auto x = distribution(generator);
+                    tree.concurrent_add(x, x);
+                }
+            });
+        for (auto & thread : threads)
+            thread.join();
+        auto end = std::chrono::system_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::duration<int, std::milli>>(end - start);
+        std::cout << "Concurrent add, " << threads_count << " threads: " << duration.count() << " ms, "
+                  << size * 1000 / std::max(duration.count(), 1) << " elements/s" << std::endl;
+    }
+}
+
+TEST(comparsion, parallel_flush)
+{
+    std::size_t size = 50000;
+    std::cout << "Size: " << size << " elements" << std::endl;
+
+    std::mt19937 generator;
+    std::uniform_int_distribution<std::uint64_t> distribution(1, 1000000);
+    std::vector<std::uint64_t> elements;
+    for (std::size_t i = 0; i < size; ++i)
+        elements.push_back(distribution(generator));
+
+    utils::thread_pool pool;
+    for (bool parallel : { false, true })
+    {
+        storage::memory<std::string> mem;
+        bptree::b_tree<std::uint64_t, std::uint64_t> tree(mem, 16);
+        if (parallel)
+            tree.set_flush_executor([&pool] (std::vector<std::function<void()>> & tasks) { pool.run(tasks); }, 10000);
+
+        auto start = std::chrono::system_clock::now();
+        for (auto x : elements)
+            tree.add(x, x);
+        auto end = std::chrono::system_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::duration<int, std::milli>>(end - start);
+        std::cout << (parallel ? "Parallel flush on " + std::to_string(pool.size()) + " threads: " : "Serial flush: ")
+                  << duration.count() << " ms" << std::endl;
+    }
+}
+
+TEST(comparsion, assign)
+{
+    std::size_t size = 2000;
+    std::cout << "Size: " << size << " elements" << std::endl;
+
+    std::mt19937 generator;
+    std::uniform_int_distribution<std::uint64_t> distribution(1, 1000000);
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> elements;
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        auto x = distribution(generator);
+        elements.push_back({x, x});
+    }
+
+    {
+        data::heap<std::uint64_t, std::uint64_t> heap(3);
+        auto start = std::chrono::system_clock::now();
+        for (auto x : elements)
+            heap.add(x.first, x.second);
+        auto end = std::chrono::system_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::duration<int, std::milli>>(end - start);
+        std::cout << "Filling buffer tree heap by adds: " << duration.count() << " ms" << std::endl;
+    }
+
+    {
+        data::heap<std::uint64_t, std::uint64_t> heap(3);
+        auto start = std::chrono::system_clock::now();
+        heap.assign(elements.begin(), elements.end(), size / 8);
+        auto end = std::chrono::system_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::duration<int, std::milli>>(end - start);
+        std::cout << "Filling buffer tree heap by assign: " << duration.count() << " ms" << std::endl;
+    }
+}
+
+TEST(comparsion, concurrent_heap)
+{
+    std::size_t size = 20000;
+    std::cout << "Size: " << size << " elements" << std::endl;
+
+    // Every thread adds its share of elements and removes as many
+    for (bool relaxed : { false, true })
+        for (std::size_t threads_count = 1; threads_count <= 64; threads_count *= 2)
+        {
+            storage::memory<std::string> mem;
+            data::concurrent_heap<std::uint64_t, std::uint64_t> heap(mem, 16, 2 * threads_count, 64, 64);
+
+            auto start = std::chrono::system_clock::now();
+            std::vector<std::thread> threads;
+            for (std::size_t i = 0; i < threads_count; ++i)
+                threads.emplace_back([&heap, i, size, threads_count, relaxed] ()
+                {
+                    std::mt19937 generator(i);
+                    std::uniform_int_distribution<std::uint64_t> distribution(1, 1000000);
+                    for (std::size_t j = 0; j < size / threads_count; ++j)
+                    {
+                        auto x = distribution(generator);
+                        heap.add(x, x);
+                    }
+                    for (std::size_t j = 0; j < size / threads_count; ++j)
+                        relaxed ? heap.try_remove_min_relaxed() : heap.try_remove_min();
+                });
+            for (auto & thread : threads)
+                thread.join();
+            auto end = std::chrono::system_clock::now();
+            auto duration = std::chrono::duration_cast<std::chrono::duration<int, std::milli>>(end - start);
+            std::cout << "Concurrent heap, " << (relaxed ? "relaxed" : "strict") << ", " << threads_count << " threads: "
+                      << duration.count() << " ms, "
+                      << 2 * size * 1000 / std::max(duration.count(), 1) << " operations/s" << std::endl;
+        }
+}
+
+// Fill heap with elements equal to their keys and fetch all elements back
+template <typename Heap>
+std::vector<std::pair<std::uint64_t, std::uint64_t>> fill_and_fetch(Heap & heap, const std::string & name,
+                                                                    const std::vector<std::uint64_t> & elements)
+{
+    auto start = std::chrono::system_clock::now();
+    for (auto x : elements)
+        heap.add(x, x);
+    auto filled = std::chrono::system_clock::now();
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> result;
+    while (!heap.empty())
+        result.push_back(heap.remove_min());
+    auto end = std::chrono::system_clock::now();
+
+    auto fill = std::chrono::duration_cast<std::chrono::duration<int, std::milli>>(filled - start);
+    auto fetch = std::chrono::duration_cast<std::chrono::duration<int, std::milli>>(end - filled);
+    std::cout << "Filling " << name << ": " << fill.count() << " ms" << std::endl;
+    std::cout << "Fetch elements from " << name << ": " << fetch.count() << " ms" << std::endl;
+    return result;
+}
+
+TEST(comparsion, sequence_heap)
+{
+    std::size_t size = 20000;
+    std::cout << "Size: " << size << " elements" << std::endl;
+
+    std::mt19937 generator;
+    std::uniform_int_distribution<std::uint64_t> distribution(1, 1000000);
+    std::vector<std::uint64_t> elements;
+    for (std::size_t i = 0; i < size; ++i)
+        elements.push_back(distribution(generator));
+
+    storage::memory<std::string> heap_storage, sequence_storage;
+    data::heap<std::uint64_t, std::uint64_t> heap(heap_storage, 16);
+    data::sequence_heap<std::uint64_t, std::uint64_t> sequence_heap(sequence_storage, 16);
+    auto heap_elements = fill_and_fetch(heap, "buffer tree heap", elements);
+    auto sequence_heap_elements = fill_and_fetch(sequence_heap, "sequence heap", elements);
+    EXPECT_EQ(heap_elements, sequence_heap_elements);
+}
+
+TEST(comparsion, paged_heap)
+{
+    std::size_t size = 20000;
+    std::cout << "Size: " << size << " elements" << std::endl;
+
+    std::mt19937 generator;
+    std::uniform_int_distribution<std::uint64_t> distribution(1, 1000000);
+    std::vector<std::uint64_t> elements;
+    for (std::size_t i = 0; i < size; ++i)
+        elements.push_back(distribution(generator));
+
+    // Both heaps have nodes of 31 elements and cache of 3 nodes
+    storage::memory<std::string> heap_memory, paged_heap_memory;
+    storage::counting<std::string> heap_storage(heap_memory), paged_heap_storage(paged_heap_memory);
+    data::heap<std::uint64_t, std::uint64_t> heap(heap_storage, 16);
+    simple::paged_heap<std::uint64_t, std::uint64_t> paged_heap(paged_heap_storage, 16);
+    auto heap_elements = fill_and_fetch(heap, "buffer tree heap", elements);
+    auto paged_heap_elements = fill_and_fetch(paged_heap, "paged binary heap", elements);
+    std::cout << "Buffer tree heap: " << heap_storage.total().ios() << " node transfers" << std::endl;
+    std::cout << "Paged binary heap: " << paged_heap_storage.total().ios() << " node transfers" << std::endl;
+    EXPECT_EQ(heap_elements, paged_heap_elements);
+}
+
 int main(int argc, char ** argv)
 {
     testing::InitGoogleTest(&argc, argv);
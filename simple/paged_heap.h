@@ -0,0 +1,191 @@
+#pragma once
+
+#include <btree/btree_data.h>
+#include <btree/serialize.h>
+#include <storage/cache.h>
+#include <storage/directory.h>
+
+#include <vector>
+#include <memory>
+#include <utility>
+#include <functional>
+#include <stdexcept>
+
+namespace simple
+{
+// Binary heap in an array of pages of 2 * t - 1 elements kept in the storage
+// behind the same LRU cache of cache_size pages as the buffer tree, so it is
+// a fair baseline: element i is in slot i % B of page i / B, every operation
+// walks one path of the heap and costs O(log(N / B)) page transfers when
+// the path doesn't fit in the cache
+template <typename Key, typename Value, typename Serialized = std::string>
+struct paged_heap
+{
+    using serializer_t = std::function<Serialized *(detail::b_node_data<Key, Value> *)>;
+    using deserializer_t = std::function<detail::b_node_data<Key, Value> *(Serialized *)>;
+
+    static constexpr std::size_t default_cache_size = 3;
+
+    paged_heap(std::size_t t, const fs::path & path = "storage", std::size_t cache_size = default_cache_size)
+        : paged_heap(std::unique_ptr<storage::basic_storage<Serialized>>(new storage::directory<Serialized>(path)),
+                     t, cache_size, bptree::serialize, bptree::deserialize)
+    {}
+
+    // Heap in the storage owned by the caller, storage should outlive the heap
+    paged_heap(storage::basic_storage<Serialized> & storage,
+               std::size_t t,
+               std::size_t cache_size = default_cache_size,
+               serializer_t serializer = bptree::serialize,
+               deserializer_t deserializer = bptree::deserialize)
+        : paged_heap(nullptr, storage, t, cache_size, serializer, deserializer)
+    {}
+
+    paged_heap(const paged_heap & other) = delete;
+
+    // Heap is not persistent, its pages are deleted
+    ~paged_heap()
+    {
+        for (auto id : pages)
+            cache.delete_node(id);
+    }
+
+    void add(Key k, Value v)
+    {
+        if (size_ % page_size == 0)
+            pages.push_back(cache.new_node([] (storage::node_id id) { return new page(id); })->id_);
+        page_for(size_)->values_.push_back({ k, v });
+        sift_up(size_++);
+    }
+
+    std::pair<Key, Value> remove_min()
+    {
+        if (empty())
+            throw std::runtime_error("Trying to remove minimal element from empty heap");
+
+        std::shared_ptr<page> last_page = page_for(size_ - 1);
+        std::pair<Key, Value> last = last_page->values_.back();
+        last_page->values_.pop_back();
+        --size_;
+        if (size_ % page_size == 0)
+        {
+            cache.delete_node(pages.back());
+            pages.pop_back();
+        }
+        if (size_ == 0)
+            return last;
+
+        std::pair<Key, Value> & top = element(0);
+        std::pair<Key, Value> result = top;
+        top = last;
+        sift_down(0);
+        return result;
+    }
+
+    // Move up to k minimal elements to out in ascending order
+    template <typename OutIter>
+    OutIter remove_min(std::size_t k, OutIter out)
+    {
+        for (; k > 0 && !empty(); --k)
+        {
+            *out = remove_min();
+            ++out;
+        }
+        return out;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+private:
+    using page = detail::b_leaf_data<Key, Value>;
+
+    paged_heap(std::unique_ptr<storage::basic_storage<Serialized>> && owned,
+               std::size_t t,
+               std::size_t cache_size,
+               serializer_t serializer,
+               deserializer_t deserializer)
+        : paged_heap(std::move(owned), *owned, t, cache_size, serializer, deserializer)
+    {}
+
+    paged_heap(std::unique_ptr<storage::basic_storage<Serialized>> && owned,
+               storage::basic_storage<Serialized> & storage,
+               std::size_t t,
+               std::size_t cache_size,
+               serializer_t serializer,
+               deserializer_t deserializer)
+        : page_size(2 * t - 1)
+        , size_(0)
+        , owned_storage(std::move(owned))
+        , cache(storage,
+                [deserializer] (Serialized * x) { return static_cast<page *>(deserializer(x)); },
+                [serializer] (page * x) { return serializer(x); },
+                cache_size)
+    {}
+
+    std::shared_ptr<page> page_for(std::size_t i)
+    {
+        return cache[pages[i / page_size]];
+    }
+
+    // Reference is valid until another page is accessed
+    std::pair<Key, Value> & element(std::size_t i)
+    {
+        return page_for(i)->values_[i % page_size];
+    }
+
+    void sift_up(std::size_t i)
+    {
+        std::pair<Key, Value> x = element(i);
+        while (i > 0)
+        {
+            std::size_t parent = (i - 1) / 2;
+            std::pair<Key, Value> p = element(parent);
+            if (!(x.first < p.first))
+                break;
+            element(i) = p;
+            i = parent;
+        }
+        element(i) = x;
+    }
+
+    void sift_down(std::size_t i)
+    {
+        std::pair<Key, Value> x = element(i);
+        while (2 * i + 1 < size_)
+        {
+            std::size_t child = 2 * i + 1;
+            std::pair<Key, Value> c = element(child);
+            if (child + 1 < size_)
+            {
+                std::pair<Key, Value> right = element(child + 1);
+                if (right.first < c.first)
+                {
+                    c = right;
+                    ++child;
+                }
+            }
+            if (!(c.first < x.first))
+                break;
+            element(i) = c;
+            i = child;
+        }
+        element(i) = x;
+    }
+
+    std::size_t page_size;
+    std::size_t size_;
+    std::vector<storage::node_id> pages;
+    std::unique_ptr<storage::basic_storage<Serialized>> owned_storage;
+    storage::cache<page, Serialized> cache;
+};
+
+template <typename Key, typename Value, typename Serialized>
+constexpr std::size_t paged_heap<Key, Value, Serialized>::default_cache_size;
+}
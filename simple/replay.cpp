@@ -0,0 +1,194 @@
+// Replay of a heap operations trace recorded with data::heap::set_trace
+//
+//     replay [--engine heap|sequence|radix] [--storage memory|directory] [--path dir]
+//            [--t t] [--cache nodes] [--memory bytes] [--profile n] trace
+//
+// Operations are applied to an empty heap of the chosen engine and configuration,
+// replay time and storage accesses are reported. Operations the engine doesn't
+// have (e.g. erase in sequence heap) are skipped and counted.
+// With --profile, storage accesses to every node are counted and the n hottest nodes,
+// accesses, allocations and deletions by node kind and, for the heap engine,
+// the shape of its tree after the replay are reported. Accesses are cache misses
+// and write-backs, hits in the node cache are not seen.
+// Directory storage is a new subdirectory of path, which is removed after the replay.
+
+#include <heap/heap.h>
+#include <heap/radix_heap.h>
+#include <heap/sequence_heap.h>
+#include <heap/trace.h>
+#include <storage/memory.h>
+#include <storage/directory.h>
+#include <storage/counting.h>
+#include <storage/heat_map.h>
+#include <btree/shape.h>
+#include <utils/temp_directory.h>
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+struct options
+{
+    std::string engine = "heap";
+    std::string storage = "memory";
+    fs::path path = "replay_storage";
+    std::size_t t = 64;
+    std::size_t cache_size = 3;
+    std::size_t memory = 0;
+    std::size_t profile = 0;
+    fs::path trace;
+};
+
+template <typename Heap>
+data::replay_stats replay(const fs::path & trace, Heap & heap)
+{
+    std::ifstream in(trace.string(), std::ios_base::binary);
+    if (!in)
+        throw std::runtime_error("Can't open " + trace.string());
+    data::trace_reader reader(in);
+    return data::replay(reader, heap);
+}
+
+data::replay_stats run(const options & o, storage::basic_storage<std::string> & storage)
+{
+    if (o.engine == "sequence")
+    {
+        data::sequence_heap<std::uint64_t, std::uint64_t> heap(storage, o.t);
+        return replay(o.trace, heap);
+    }
+    if (o.engine == "radix")
+    {
+        data::radix_heap<std::uint64_t, std::uint64_t> heap(storage, o.t);
+        return replay(o.trace, heap);
+    }
+
+    data::heap<std::uint64_t, std::uint64_t> heap(storage, o.t, o.cache_size);
+    if (o.memory > 0)
+        heap.set_memory_budget(o.memory);
+    auto stats = replay(o.trace, heap);
+    if (o.profile > 0)
+    {
+        std::cout << "Tree shape:" << std::endl;
+        bptree::print(std::cout, heap.shape(), o.t);
+    }
+    return stats;
+}
+
+void print_heat(const storage::heat_map<std::string> & heat, std::size_t n)
+{
+    std::cout << "Storage accesses (cache misses and write-backs) by node kind:" << std::endl;
+    for (auto & x : heat.by_kind())
+        std::cout << "    " << x.first.type << " level " << x.first.level << ": " << x.second.nodes << " nodes, "
+                  << x.second.allocated << " allocated, " << x.second.deleted << " deleted, "
+                  << double(x.second.ios.ios()) / std::max<std::size_t>(x.second.nodes, 1) << " accesses per node, max "
+                  << x.second.max_ios << std::endl;
+
+    std::cout << "Nodes with the most storage accesses:" << std::endl;
+    for (auto & x : heat.hottest(n))
+        std::cout << "    " << x.first << " (" << x.second.kind.type << " level " << x.second.kind.level
+                  << (x.second.deleted ? ", deleted" : "") << "): " << x.second.ios.loads << " loads, "
+                  << x.second.ios.writes << " writes" << std::endl;
+}
+
+void usage()
+{
+    std::cerr << "Usage: replay [--engine heap|sequence|radix] [--storage memory|directory] [--path dir]"
+              << " [--t t] [--cache nodes] [--memory bytes] [--profile n] trace" << std::endl;
+}
+}
+
+int main(int argc, char ** argv)
+{
+    options o;
+    std::vector<std::string> files;
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg.compare(0, 2, "--") != 0)
+            {
+                files.push_back(arg);
+                continue;
+            }
+            if (i + 1 == argc)
+                throw std::invalid_argument("Missing value of " + arg);
+
+            std::string value = argv[++i];
+            if (arg == "--engine")
+                o.engine = value;
+            else if (arg == "--storage")
+                o.storage = value;
+            else if (arg == "--path")
+                o.path = value;
+            else if (arg == "--t")
+                o.t = std::stoull(value);
+            else if (arg == "--cache")
+                o.cache_size = std::stoull(value);
+            else if (arg == "--memory")
+                o.memory = std::stoull(value);
+            else if (arg == "--profile")
+                o.profile = std::stoull(value);
+            else
+                throw std::invalid_argument("Unknown option " + arg);
+        }
+        if (files.size() != 1 || o.t < 2)
+            throw std::invalid_argument("Wrong arguments");
+        if (o.engine != "heap" && o.engine != "sequence" && o.engine != "radix")
+            throw std::invalid_argument("Unknown engine " + o.engine);
+        if (o.storage != "memory" && o.storage != "directory")
+            throw std::invalid_argument("Unknown storage " + o.storage);
+    }
+    catch (std::exception & e)
+    {
+        std::cerr << e.what() << std::endl;
+        usage();
+        return 1;
+    }
+    o.trace = files[0];
+
+    try
+    {
+        std::unique_ptr<utils::temp_directory> temp;
+        std::unique_ptr<storage::basic_storage<std::string>> backend;
+        if (o.storage == "memory")
+            backend.reset(new storage::memory<std::string>());
+        else
+        {
+            temp.reset(new utils::temp_directory(o.path));
+            backend.reset(new storage::directory<std::string>(temp->path()));
+        }
+        storage::heat_map<std::string> heat(*backend, bptree::classify);
+        storage::counting<std::string> counted(heat, bptree::classify);
+
+        auto start = std::chrono::steady_clock::now();
+        auto stats = run(o, counted);
+        auto end = std::chrono::steady_clock::now();
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        auto ios = counted.total();
+        std::cout << "Operations: " << stats.operations << ", skipped: " << stats.skipped
+                  << ", batches: " << stats.marks << std::endl;
+        std::cout << "Recorded in " << stats.recorded_time / 1e9 << " s, replayed in " << seconds << " s, "
+                  << stats.operations / seconds << " operations/s" << std::endl;
+        std::cout << "Loads: " << ios.loads << ", writes: " << ios.writes << ", deletes: " << ios.deletes
+                  << ", bytes loaded: " << ios.bytes_loaded << ", bytes written: " << ios.bytes_written << std::endl;
+        for (auto & x : counted.by_kind())
+            std::cout << "    " << x.first.type << " level " << x.first.level << ": "
+                      << x.second.loads << " loads, " << x.second.writes << " writes" << std::endl;
+        if (o.profile > 0)
+            print_heat(heat, o.profile);
+    }
+    catch (std::exception & e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,360 @@
+// External sort of a binary file of records
+// Record is a pair of 64-bit key and value in native byte order, records are sorted by key.
+//
+//     sort [--memory bytes] [--temp dir] [--t t] [--method heap|merge|both] [--generate n] input output
+//
+// heap method streams records through data::heap: they are cut into sorted runs, merged
+// and bulk loaded to the tree, then removed from the heap by batches.
+// merge method is the classic external sort: sorted runs of memory size are written
+// to temporary files and merged with a k-way merge.
+// With --generate, input is first filled with n random records.
+// Temporary files are kept in a new subdirectory of temp, which is removed after the sort.
+
+#include <heap/heap.h>
+#include <utils/temp_directory.h>
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+using record = std::pair<std::uint64_t, std::uint64_t>;
+
+// Records are read and written by blocks of this many records
+constexpr std::size_t block_size = 1 << 14;
+
+struct record_reader
+{
+    record_reader(const fs::path & path)
+        : in(path.string(), std::ios_base::binary)
+        , position(0)
+    {
+        if (!in)
+            throw std::runtime_error("Can't open " + path.string());
+    }
+
+    bool next(record & r)
+    {
+        if (position == block.size())
+        {
+            block.resize(block_size);
+            in.read(reinterpret_cast<char *>(block.data()), block_size * sizeof(record));
+            block.resize(in.gcount() / sizeof(record));
+            position = 0;
+            if (block.empty())
+                return false;
+        }
+        r = block[position++];
+        return true;
+    }
+
+private:
+    std::ifstream in;
+    std::vector<record> block;
+    std::size_t position;
+};
+
+// Single pass input iterator over records of a reader
+struct record_iterator
+{
+    using iterator_category = std::input_iterator_tag;
+    using value_type = record;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const record *;
+    using reference = const record &;
+
+    record_iterator()
+        : reader(nullptr)
+    {}
+
+    record_iterator(record_reader & reader)
+        : reader(&reader)
+    {
+        ++*this;
+    }
+
+    const record & operator*() const
+    {
+        return current;
+    }
+
+    record_iterator & operator++()
+    {
+        if (!reader->next(current))
+            reader = nullptr;
+        return *this;
+    }
+
+    bool operator==(const record_iterator & other) const
+    {
+        return reader == other.reader;
+    }
+
+    bool operator!=(const record_iterator & other) const
+    {
+        return reader != other.reader;
+    }
+
+private:
+    record_reader * reader;
+    record current;
+};
+
+struct record_writer
+{
+    record_writer(const fs::path & path)
+        : out(path.string(), std::ios_base::binary)
+    {
+        if (!out)
+            throw std::runtime_error("Can't open " + path.string());
+        block.reserve(block_size);
+    }
+
+    void write(const record & r)
+    {
+        block.push_back(r);
+        if (block.size() == block_size)
+            flush();
+    }
+
+    void flush()
+    {
+        out.write(reinterpret_cast<const char *>(block.data()), block.size() * sizeof(record));
+        block.clear();
+    }
+
+    ~record_writer()
+    {
+        flush();
+    }
+
+private:
+    std::ofstream out;
+    std::vector<record> block;
+};
+
+struct options
+{
+    std::size_t memory = 64 << 20;
+    fs::path temp = "sort_temp";
+    std::size_t t = 1024;
+    std::string method = "heap";
+    std::size_t generate = 0;
+    fs::path input;
+    fs::path output;
+};
+
+void generate(const fs::path & path, std::size_t n)
+{
+    std::mt19937_64 generator;
+    record_writer out(path);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        std::uint64_t k = generator();
+        out.write({ k, i });
+    }
+}
+
+// Records fitting in the memory limit, at least two blocks
+std::size_t run_size(const options & o)
+{
+    return std::max(2 * block_size, o.memory / sizeof(record));
+}
+
+void heap_sort(const options & o)
+{
+    // Memory budget sizes the node cache as well
+    data::heap<std::uint64_t, std::uint64_t> heap(o.t, o.temp / "heap");
+    heap.set_memory_budget(o.memory);
+
+    record_reader in(o.input);
+    heap.assign(record_iterator(in), record_iterator(), run_size(o));
+
+    record_writer out(o.output);
+    std::vector<record> batch;
+    while (!heap.empty())
+    {
+        batch.clear();
+        heap.remove_min(block_size, std::back_inserter(batch));
+        for (auto & r : batch)
+            out.write(r);
+    }
+}
+
+void merge_sort(const options & o)
+{
+    // Run formation
+    std::vector<fs::path> runs;
+    {
+        record_reader in(o.input);
+        std::vector<record> run;
+        run.reserve(run_size(o));
+        record r;
+        bool more = true;
+        while (more)
+        {
+            more = in.next(r);
+            if (more)
+                run.push_back(r);
+            if (run.size() == run_size(o) || (!more && !run.empty()))
+            {
+                std::sort(run.begin(), run.end());
+                runs.push_back(o.temp / ("run" + std::to_string(runs.size())));
+                record_writer out(runs.back());
+                for (auto & x : run)
+                    out.write(x);
+                run.clear();
+            }
+        }
+    }
+
+    // K-way merge
+    std::vector<std::unique_ptr<record_reader>> readers;
+    using head = std::pair<record, std::size_t>;
+    std::priority_queue<head, std::vector<head>, std::greater<head>> heads;
+    for (auto & run : runs)
+    {
+        readers.emplace_back(new record_reader(run));
+        record r;
+        if (readers.back()->next(r))
+            heads.push({ r, readers.size() - 1 });
+    }
+
+    record_writer out(o.output);
+    while (!heads.empty())
+    {
+        head h = heads.top();
+        heads.pop();
+        out.write(h.first);
+        if (readers[h.second]->next(h.first))
+            heads.push(h);
+    }
+    readers.clear();
+
+    for (auto & run : runs)
+        fs::remove(run);
+}
+
+// Output should be a sorted permutation of the input, compared by size and sums of fields
+void check(const options & o)
+{
+    record_reader in(o.input), out(o.output);
+    record r, previous(0, 0);
+    std::uint64_t input_keys = 0, input_values = 0, output_keys = 0, output_values = 0;
+    while (in.next(r))
+    {
+        input_keys += r.first;
+        input_values += r.second;
+    }
+    while (out.next(r))
+    {
+        if (r.first < previous.first)
+            throw std::runtime_error("Output is not sorted");
+        output_keys += r.first;
+        output_values += r.second;
+        previous = r;
+    }
+    if (fs::file_size(o.input) != fs::file_size(o.output)
+        || input_keys != output_keys || input_values != output_values)
+        throw std::runtime_error("Output is not a permutation of input");
+}
+
+void run(const std::string & method, std::function<void(const options &)> sort, const options & o)
+{
+    double seconds;
+    {
+        utils::temp_directory temp(o.temp);
+        options sort_options = o;
+        sort_options.temp = temp.path();
+        auto start = std::chrono::steady_clock::now();
+        sort(sort_options);
+        auto end = std::chrono::steady_clock::now();
+        seconds = std::chrono::duration<double>(end - start).count();
+    }
+    check(o);
+
+    double megabytes = double(fs::file_size(o.input)) / (1 << 20);
+    std::cout << method << ": " << megabytes << " MB in " << seconds << " s, "
+              << megabytes / seconds << " MB/s" << std::endl;
+}
+
+void usage()
+{
+    std::cerr << "Usage: sort [--memory bytes] [--temp dir] [--t t] [--method heap|merge|both]"
+              << " [--generate n] input output" << std::endl;
+}
+}
+
+int main(int argc, char ** argv)
+{
+    options o;
+    std::vector<std::string> files;
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg.compare(0, 2, "--") != 0)
+            {
+                files.push_back(arg);
+                continue;
+            }
+            if (i + 1 == argc)
+                throw std::invalid_argument("Missing value of " + arg);
+
+            std::string value = argv[++i];
+            if (arg == "--memory")
+                o.memory = std::stoull(value);
+            else if (arg == "--temp")
+                o.temp = value;
+            else if (arg == "--t")
+                o.t = std::stoull(value);
+            else if (arg == "--method")
+                o.method = value;
+            else if (arg == "--generate")
+                o.generate = std::stoull(value);
+            else
+                throw std::invalid_argument("Unknown option " + arg);
+        }
+        if (files.size() != 2 || o.t < 2)
+            throw std::invalid_argument("Wrong arguments");
+        if (o.method != "heap" && o.method != "merge" && o.method != "both")
+            throw std::invalid_argument("Unknown method " + o.method);
+    }
+    catch (std::exception & e)
+    {
+        std::cerr << e.what() << std::endl;
+        usage();
+        return 1;
+    }
+
+    o.input = files[0];
+    o.output = files[1];
+    if (o.generate > 0)
+        generate(o.input, o.generate);
+
+    try
+    {
+        if (o.method != "merge")
+            run("heap", heap_sort, o);
+        if (o.method != "heap")
+            run("merge", merge_sort, o);
+    }
+    catch (std::exception & e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+// Shape of the tree of a heap or a B-tree written to a storage directory
+//
+//     tree_shape [--root id --t t] dir
+//
+// By default dir is a heap flushed by data::heap::flush (or closed), its tree is
+// found by the superblock. With --root, dir holds a bare tree with the given root
+// node and parameter t. For every level depth, number of nodes, fanout histogram
+// and pending elements of buffers relative to t (the buffer size that triggers
+// a flush) are printed. Nodes are only read.
+
+#include <heap/heap.h>
+#include <btree/shape.h>
+#include <storage/directory.h>
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+using heap_t = data::heap<std::uint64_t, std::uint64_t>;
+
+void usage()
+{
+    std::cerr << "Usage: tree_shape [--root id --t t] dir" << std::endl;
+}
+}
+
+int main(int argc, char ** argv)
+{
+    boost::optional<storage::node_id> root;
+    std::size_t t = 0;
+    std::vector<std::string> files;
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg.compare(0, 2, "--") != 0)
+            {
+                files.push_back(arg);
+                continue;
+            }
+            if (i + 1 == argc)
+                throw std::invalid_argument("Missing value of " + arg);
+
+            std::string value = argv[++i];
+            if (arg == "--root")
+                root = std::stoull(value);
+            else if (arg == "--t")
+                t = std::stoull(value);
+            else
+                throw std::invalid_argument("Unknown option " + arg);
+        }
+        if (files.size() != 1 || (root && t < 2))
+            throw std::invalid_argument("Wrong arguments");
+        if (!fs::is_directory(files[0]))
+            throw std::invalid_argument("No directory " + files[0]);
+    }
+    catch (std::exception & e)
+    {
+        std::cerr << e.what() << std::endl;
+        usage();
+        return 1;
+    }
+
+    try
+    {
+        storage::directory<std::string> storage(files[0]);
+        if (!root)
+        {
+            std::shared_ptr<std::string> serialized = storage.load_node(heap_t::superblock_id);
+            auto superblock = data::deserialize_superblock(serialized.get());
+            root = superblock.root_;
+            t = superblock.t_;
+            std::cout << "Heap: t = " << t << ", " << superblock.small_.size() << " elements in small set, "
+                      << superblock.big_size_ << " in tree" << std::endl;
+        }
+
+        auto shape = bptree::inspect<std::uint64_t, std::uint64_t, std::string>(storage, root, bptree::deserialize);
+        bptree::print(std::cout, shape, t);
+    }
+    catch (std::exception & e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
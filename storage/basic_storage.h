@@ -7,9 +7,12 @@
 
 namespace storage
 {
+// Implementations are called concurrently by the cache and should be thread-safe
 template <typename Serialized>
 struct basic_storage
 {
+    virtual ~basic_storage() = default;
+
     virtual node_id new_node() const = 0;
     virtual std::shared_ptr<Serialized> load_node(const node_id & id) const = 0;
     virtual void delete_node(const node_id & id) = 0;
@@ -5,8 +5,10 @@
 #include <memory>
 #include <list>
 #include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
 #include <functional>
+#include <mutex>
 
 namespace storage
 {
@@ -21,25 +23,101 @@ struct cache
         , deserializer(deserializer)
         , serializer(serializer)
         , cache_limit(cache_limit)
+        , resident_limit(0)
     {}
 
+    // Nodes for which resident() is true when they get to the cache are kept
+    // in a separate LRU list of resident_limit nodes, so they are not evicted
+    // by other nodes. Nodes evicted from this list become usual cached nodes.
+    void set_resident(std::function<bool(Node *)> resident, std::size_t resident_limit)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        this->resident = resident;
+        this->resident_limit = resident_limit;
+        evict();
+    }
+
+    // Keep up to cache_limit usual nodes, evicting least recently used ones at once
+    void set_limit(std::size_t cache_limit)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        this->cache_limit = cache_limit;
+        evict();
+    }
+
+    // Nodes got from the cache by the thread while its guard is alive are pinned:
+    // they are not written back and dropped, so references to their data obtained
+    // by concurrent operations stay valid. Other nodes are evicted as usual, pinned
+    // ones when the last guard holding them is destroyed. Guards are per thread,
+    // tasks that run on other threads should have their own guards.
+    struct eviction_guard
+    {
+        eviction_guard(cache & c)
+            : cache_(c)
+            , previous(current_guard())
+        {
+            current_guard() = this;
+        }
+
+        eviction_guard(const eviction_guard &) = delete;
+
+        ~eviction_guard()
+        {
+            current_guard() = previous;
+            std::lock_guard<std::mutex> lock(cache_.mutex_);
+            for (auto id : pinned)
+            {
+                auto it = cache_.cached_nodes.find(id);
+                if (it != cache_.cached_nodes.end())
+                    --it->second.pins;
+            }
+            cache_.evict();
+        }
+
+    private:
+        friend struct cache;
+
+        cache & cache_;
+        eviction_guard * previous;
+        std::unordered_set<node_id> pinned;
+    };
+
     std::shared_ptr<Node> new_node(std::function<Node *(node_id)> construct)
     {
         node_id id = storage_.new_node();
         std::shared_ptr<Node> node(construct(id));
-        cached_nodes.emplace(id, node);
-        recently_used(id);
+        std::lock_guard<std::mutex> lock(mutex_);
+        insert(id, node);
+        return node;
+    }
+
+    // Allocate id for a node that will be constructed later
+    node_id new_id()
+    {
+        return storage_.new_node();
+    }
+
+    // Put node with id allocated by new_id() to the cache
+    std::shared_ptr<Node> new_node(const node_id & id, Node * constructed)
+    {
+        std::shared_ptr<Node> node(constructed);
+        std::lock_guard<std::mutex> lock(mutex_);
+        insert(id, node);
         return node;
     }
 
     std::shared_ptr<Node> operator[](const node_id & id)
     {
-        auto it = cached_nodes.find(id);
-        if (it != cached_nodes.end())
         {
-            remove_from_lru(id);
-            recently_used(id);
-            return it->second;
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = cached_nodes.find(id);
+            if (it != cached_nodes.end())
+            {
+                auto & lru = it->second.resident ? resident_lru : last_recently_used;
+                lru.splice(lru.end(), lru, it->second.lru_position);
+                pin(id, it->second);
+                return it->second.node;
+            }
         }
 
         return load_node(id);
@@ -48,69 +126,144 @@ struct cache
     void delete_node(const node_id & id)
     {
         storage_.delete_node(id);
-        cached_nodes.erase(id);
-        remove_from_lru(id);
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = cached_nodes.find(id);
+        if (it == cached_nodes.end())
+            return;
+        (it->second.resident ? resident_lru : last_recently_used).erase(it->second.lru_position);
+        cached_nodes.erase(it);
     }
 
     void flush()
     {
-        for (auto node : cached_nodes)
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto & node : cached_nodes)
         {
-            std::shared_ptr<Stored> serialized(serializer(node.second.get()));
+            std::shared_ptr<Stored> serialized(serializer(node.second.node.get()));
             storage_.write_node(node.first, serialized.get());
         }
     }
 
+    // Forget all cached nodes without writing them
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cached_nodes.clear();
+        last_recently_used.clear();
+        resident_lru.clear();
+    }
+
+    basic_storage<Stored> & backing_storage() const
+    {
+        return storage_;
+    }
+
     ~cache()
     {
         flush();
     }
 
 private:
+    struct entry
+    {
+        std::shared_ptr<Node> node;
+        std::list<node_id>::iterator lru_position;
+        bool resident;
+        // Number of guards holding the node
+        std::size_t pins;
+    };
+
+    // Innermost guard of the thread
+    static eviction_guard *& current_guard()
+    {
+        static thread_local eviction_guard * guard = nullptr;
+        return guard;
+    }
+
+    void pin(const node_id & id, entry & e)
+    {
+        for (eviction_guard * guard = current_guard(); guard; guard = guard->previous)
+            if (&guard->cache_ == this)
+            {
+                if (guard->pinned.insert(id).second)
+                    ++e.pins;
+                return;
+            }
+    }
+
     std::shared_ptr<Node> load_node(const node_id & id)
     {
+        // Storage is accessed without holding the lock,
+        // so loads of different nodes can proceed in parallel
         std::shared_ptr<Stored> x = storage_.load_node(id);
         std::shared_ptr<Node> node(deserializer(x.get()));
-        cached_nodes.emplace(id, node);
-        recently_used(id);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Node could be loaded by another thread in the meantime
+        auto it = cached_nodes.find(id);
+        if (it != cached_nodes.end())
+        {
+            pin(id, it->second);
+            return it->second.node;
+        }
+
+        insert(id, node);
         return node;
     }
 
     void write_node(const node_id & id)
     {
-        std::shared_ptr<Node> node = cached_nodes[id];
+        std::shared_ptr<Node> node = cached_nodes[id].node;
         std::shared_ptr<Stored> serialized(serializer(node.get()));
         storage_.write_node(id, serialized.get());
     }
 
-    void write_node(const node_id & id, Node * node)
+    void insert(const node_id & id, std::shared_ptr<Node> node)
     {
-        storage_.write_node(id, node);
+        bool is_resident = resident_limit > 0 && resident && resident(node.get());
+        auto & lru = is_resident ? resident_lru : last_recently_used;
+        auto lru_it = lru.insert(lru.end(), id);
+        entry & e = cached_nodes[id];
+        e = entry{ node, lru_it, is_resident, 0 };
+        pin(id, e);
+        evict();
     }
 
-    void remove_from_lru(const node_id & id)
+    void evict()
     {
-        auto lru_it = std::find(last_recently_used.begin(), last_recently_used.end(), id);
-        last_recently_used.erase(lru_it);
-    }
+        while (resident_lru.size() > resident_limit)
+        {
+            node_id demoted = resident_lru.front();
+            entry & e = cached_nodes[demoted];
+            last_recently_used.splice(last_recently_used.end(), resident_lru, e.lru_position);
+            e.resident = false;
+        }
 
-    void recently_used(const node_id & id)
-    {
-        if (last_recently_used.size() == cache_limit)
+        // Pinned nodes are skipped, so the cache exceeds its limit by at most their number
+        auto it = last_recently_used.begin();
+        while (last_recently_used.size() > cache_limit && it != last_recently_used.end())
         {
-            node_id flushed = last_recently_used.front();
-            last_recently_used.pop_front();
+            node_id flushed = *it;
+            if (cached_nodes[flushed].pins > 0)
+            {
+                ++it;
+                continue;
+            }
+            it = last_recently_used.erase(it);
             write_node(flushed);
             cached_nodes.erase(flushed);
         }
-        last_recently_used.push_back(id);
     }
 
     basic_storage<Stored> & storage_;
     deserializer_t deserializer;
     serializer_t serializer;
-    std::unordered_map<node_id, std::shared_ptr<Node>> cached_nodes;
+    std::unordered_map<node_id, entry> cached_nodes;
     std::size_t cache_limit;
     std::list<node_id> last_recently_used;
+    std::function<bool(Node *)> resident;
+    std::size_t resident_limit;
+    std::list<node_id> resident_lru;
+    std::mutex mutex_;
 };
 }
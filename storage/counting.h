@@ -0,0 +1,125 @@
+#pragma once
+
+#include "basic_storage.h"
+#include "node_kind.h"
+
+#include <map>
+#include <unordered_map>
+#include <string>
+#include <memory>
+#include <functional>
+#include <mutex>
+
+namespace storage
+{
+struct io_counters
+{
+    std::size_t loads = 0;
+    std::size_t writes = 0;
+    std::size_t deletes = 0;
+    std::size_t bytes_loaded = 0;
+    std::size_t bytes_written = 0;
+
+    // Block transfers
+    std::size_t ios() const
+    {
+        return loads + writes;
+    }
+
+    io_counters & operator+=(const io_counters & other)
+    {
+        loads += other.loads;
+        writes += other.writes;
+        deletes += other.deletes;
+        bytes_loaded += other.bytes_loaded;
+        bytes_written += other.bytes_written;
+        return *this;
+    }
+};
+
+// Storage that passes all calls to another storage and counts them by node kinds
+// Kind of a node is found by classifier when the node is written or loaded and
+// is remembered for deletion. Serialized should have size() in bytes.
+template <typename Serialized>
+struct counting : basic_storage<Serialized>
+{
+    using classifier_t = std::function<node_kind(const Serialized &)>;
+
+    counting(basic_storage<Serialized> & storage,
+             classifier_t classifier = [] (const Serialized &) { return node_kind{ "node", 0 }; })
+        : storage_(storage)
+        , classifier(classifier)
+    {}
+
+    virtual node_id new_node() const
+    {
+        return storage_.new_node();
+    }
+
+    virtual std::shared_ptr<Serialized> load_node(const node_id & id) const
+    {
+        std::shared_ptr<Serialized> node = storage_.load_node(id);
+        node_kind kind = classifier(*node);
+        std::lock_guard<std::mutex> lock(mutex_);
+        io_counters & c = counters[kind];
+        ++c.loads;
+        c.bytes_loaded += node->size();
+        kinds[id] = kind;
+        return node;
+    }
+
+    virtual void delete_node(const node_id & id)
+    {
+        storage_.delete_node(id);
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = kinds.find(id);
+        if (it == kinds.end())
+        {
+            ++counters[node_kind{ "unknown", 0 }].deletes;
+            return;
+        }
+        ++counters[it->second].deletes;
+        kinds.erase(it);
+    }
+
+    virtual void write_node(const node_id & id, Serialized * node)
+    {
+        storage_.write_node(id, node);
+        node_kind kind = classifier(*node);
+        std::lock_guard<std::mutex> lock(mutex_);
+        io_counters & c = counters[kind];
+        ++c.writes;
+        c.bytes_written += node->size();
+        kinds[id] = kind;
+    }
+
+    std::map<node_kind, io_counters> by_kind() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return counters;
+    }
+
+    io_counters total() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        io_counters result;
+        for (auto & c : counters)
+            result += c.second;
+        return result;
+    }
+
+    // Forget counts, kinds of stored nodes are kept
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        counters.clear();
+    }
+
+private:
+    basic_storage<Serialized> & storage_;
+    classifier_t classifier;
+    mutable std::map<node_kind, io_counters> counters;
+    mutable std::unordered_map<node_id, node_kind> kinds;
+    mutable std::mutex mutex_;
+};
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "basic_storage.h"
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+
+namespace storage
+{
+// Timing of a block device
+struct device_profile
+{
+    // Time of every access
+    std::chrono::nanoseconds latency;
+    // Extra time of an access to a node that doesn't follow the previously accessed one
+    std::chrono::nanoseconds seek;
+    // Bytes per second
+    double bandwidth;
+    // Number of accesses served at once
+    std::size_t queue_depth;
+
+    static device_profile hdd()
+    {
+        return { std::chrono::microseconds(4200), std::chrono::microseconds(8000), 150e6, 1 };
+    }
+
+    static device_profile sata_ssd()
+    {
+        return { std::chrono::microseconds(80), std::chrono::nanoseconds(0), 500e6, 32 };
+    }
+
+    static device_profile nvme()
+    {
+        return { std::chrono::microseconds(20), std::chrono::nanoseconds(0), 3e9, 64 };
+    }
+};
+
+// Storage that passes all calls to another storage and simulates the time they take
+// on a device: loads and writes take latency, seek unless the node id follows
+// the previous one, and transfer time of their bytes; deletes take latency only.
+// Every thread waits for its accesses, accesses of different threads are served by
+// queue_depth channels in parallel. Simulated time doesn't depend on the speed of
+// the real storage, with inject set it is also spent by sleeping.
+// Serialized should have size() in bytes.
+template <typename Serialized>
+struct device : basic_storage<Serialized>
+{
+    device(basic_storage<Serialized> & storage, const device_profile & profile, bool inject = false)
+        : storage_(storage)
+        , profile(profile)
+        , inject(inject)
+        , channels(std::max<std::size_t>(profile.queue_depth, 1), std::chrono::nanoseconds(0))
+        , last_id(0)
+        , elapsed_(0)
+    {}
+
+    virtual node_id new_node() const
+    {
+        return storage_.new_node();
+    }
+
+    virtual std::shared_ptr<Serialized> load_node(const node_id & id) const
+    {
+        std::shared_ptr<Serialized> node = storage_.load_node(id);
+        access(id, node->size());
+        return node;
+    }
+
+    virtual void delete_node(const node_id & id)
+    {
+        storage_.delete_node(id);
+        wait(profile.latency);
+    }
+
+    virtual void write_node(const node_id & id, Serialized * node)
+    {
+        storage_.write_node(id, node);
+        access(id, node->size());
+    }
+
+    // Simulated time since creation or reset, when the last access completes
+    std::chrono::nanoseconds elapsed() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return elapsed_;
+    }
+
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::fill(channels.begin(), channels.end(), std::chrono::nanoseconds(0));
+        clocks.clear();
+        elapsed_ = std::chrono::nanoseconds(0);
+    }
+
+private:
+    void access(const node_id & id, std::size_t bytes) const
+    {
+        auto time = profile.latency + std::chrono::nanoseconds(std::int64_t(bytes * 1e9 / profile.bandwidth));
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (id != last_id + 1)
+                time += profile.seek;
+            last_id = id;
+        }
+        wait(time);
+    }
+
+    // Serve access of the calling thread by the earliest free channel
+    void wait(std::chrono::nanoseconds time) const
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto & clock = clocks[std::this_thread::get_id()];
+            auto channel = std::min_element(channels.begin(), channels.end());
+            auto end = std::max(clock, *channel) + time;
+            *channel = clock = end;
+            elapsed_ = std::max(elapsed_, end);
+        }
+
+        if (inject)
+            std::this_thread::sleep_for(time);
+    }
+
+    basic_storage<Serialized> & storage_;
+    device_profile profile;
+    bool inject;
+    // Time when every channel becomes free and when every thread's last access completes
+    mutable std::vector<std::chrono::nanoseconds> channels;
+    mutable std::map<std::thread::id, std::chrono::nanoseconds> clocks;
+    mutable node_id last_id;
+    mutable std::chrono::nanoseconds elapsed_;
+    mutable std::mutex mutex_;
+};
+}
@@ -8,6 +8,7 @@
 #include <string>
 #include <fstream>
 #include <ios>
+#include <atomic>
 
 namespace fs = boost::filesystem;
 
@@ -52,11 +53,17 @@ struct directory : basic_storage<Serialized>
         fs::remove(node_path(id));
     }
 
+    // Node is written to a temporary file first and then renamed,
+    // so a node file is always either old or new version of the node
     virtual void write_node(const node_id & id, Serialized * node)
     {
-        std::ofstream out(node_path(id).string(), std::ios_base::binary);
+        fs::path path = node_path(id);
+        fs::path tmp = path;
+        tmp += ".tmp";
+        std::ofstream out(tmp.string(), std::ios_base::binary);
         out << *node;
         out.close();
+        fs::rename(tmp, path);
     }
 
     fs::path node_path(const node_id & id) const
@@ -65,7 +72,7 @@ struct directory : basic_storage<Serialized>
     }
 
 private:
-    mutable storage::node_id max_id;
+    mutable std::atomic<storage::node_id> max_id;
     fs::path storage_dir;
 };
 }
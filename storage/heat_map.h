@@ -0,0 +1,154 @@
+#pragma once
+
+#include "basic_storage.h"
+#include "counting.h"
+
+#include <unordered_map>
+#include <vector>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+
+namespace storage
+{
+// Storage that passes all calls to another storage and counts accesses to every node
+// Only accesses that reach the storage are seen, so behind a cache these are misses
+// and write-backs. Counts of deleted nodes are kept. Kinds of nodes are found by
+// classifier as in counting, allocated nodes are counted by their last known kind,
+// nodes that were allocated but never written or loaded are not reported.
+template <typename Serialized>
+struct heat_map : basic_storage<Serialized>
+{
+    using classifier_t = typename counting<Serialized>::classifier_t;
+
+    struct node_heat
+    {
+        node_kind kind;
+        io_counters ios;
+        bool allocated = false;
+        bool deleted = false;
+    };
+
+    // Nodes of one kind
+    struct kind_heat
+    {
+        std::size_t allocated = 0;
+        std::size_t deleted = 0;
+        // Nodes ever written or loaded
+        std::size_t nodes = 0;
+        io_counters ios;
+        // Maximal number of loads and writes of one node
+        std::size_t max_ios = 0;
+    };
+
+    heat_map(basic_storage<Serialized> & storage,
+             classifier_t classifier = [] (const Serialized &) { return node_kind{ "node", 0 }; })
+        : storage_(storage)
+        , classifier(classifier)
+    {}
+
+    virtual node_id new_node() const
+    {
+        node_id id = storage_.new_node();
+        std::lock_guard<std::mutex> lock(mutex_);
+        nodes_[id].allocated = true;
+        return id;
+    }
+
+    virtual std::shared_ptr<Serialized> load_node(const node_id & id) const
+    {
+        std::shared_ptr<Serialized> node = storage_.load_node(id);
+        node_kind kind = classifier(*node);
+        std::lock_guard<std::mutex> lock(mutex_);
+        node_heat & h = nodes_[id];
+        h.kind = kind;
+        ++h.ios.loads;
+        h.ios.bytes_loaded += node->size();
+        return node;
+    }
+
+    virtual void delete_node(const node_id & id)
+    {
+        storage_.delete_node(id);
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = nodes_.find(id);
+        if (it != nodes_.end())
+        {
+            ++it->second.ios.deletes;
+            it->second.deleted = true;
+        }
+    }
+
+    virtual void write_node(const node_id & id, Serialized * node)
+    {
+        storage_.write_node(id, node);
+        node_kind kind = classifier(*node);
+        std::lock_guard<std::mutex> lock(mutex_);
+        node_heat & h = nodes_[id];
+        h.kind = kind;
+        h.deleted = false;
+        ++h.ios.writes;
+        h.ios.bytes_written += node->size();
+    }
+
+    std::unordered_map<node_id, node_heat> nodes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::unordered_map<node_id, node_heat> result;
+        for (auto & x : nodes_)
+            if (x.second.ios.ios() > 0)
+                result.insert(x);
+        return result;
+    }
+
+    // Up to n nodes with the most loads and writes, the hottest first
+    std::vector<std::pair<node_id, node_heat>> hottest(std::size_t n) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::pair<node_id, node_heat>> result;
+        for (auto & x : nodes_)
+            if (x.second.ios.ios() > 0)
+                result.push_back(x);
+        n = std::min(n, result.size());
+        std::partial_sort(result.begin(), result.begin() + n, result.end(),
+                          [] (const std::pair<node_id, node_heat> & a, const std::pair<node_id, node_heat> & b)
+        {
+            return a.second.ios.ios() > b.second.ios.ios() || (a.second.ios.ios() == b.second.ios.ios() && a.first < b.first);
+        });
+        result.resize(n);
+        return result;
+    }
+
+    std::map<node_kind, kind_heat> by_kind() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::map<node_kind, kind_heat> result;
+        for (auto & x : nodes_)
+        {
+            // Kind is unknown
+            if (x.second.ios.ios() == 0)
+                continue;
+            kind_heat & k = result[x.second.kind];
+            ++k.nodes;
+            k.ios += x.second.ios;
+            k.allocated += x.second.allocated ? 1 : 0;
+            k.deleted += x.second.deleted ? 1 : 0;
+            k.max_ios = std::max(k.max_ios, x.second.ios.ios());
+        }
+        return result;
+    }
+
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        nodes_.clear();
+    }
+
+private:
+    basic_storage<Serialized> & storage_;
+    classifier_t classifier;
+    mutable std::unordered_map<node_id, node_heat> nodes_;
+    mutable std::mutex mutex_;
+};
+}
@@ -5,6 +5,9 @@
 #include <unordered_map>
 #include <memory>
 #include <functional>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
 
 namespace storage
 {
@@ -13,38 +16,46 @@ struct memory : basic_storage<Node>
 {
     memory(std::function<Node *(Node *)> copy = [] (Node * node) -> Node * { return new Node(*node); })
         : copy_(copy)
+        , counter_(1)
     {}
 
     memory(const memory<Node> & other)
         : copy_(other.copy_)
+        , counter_(other.counter_.load())
     {
+        std::shared_lock<std::shared_timed_mutex> lock(other.mutex_);
         for (auto & x : other.storage_)
             storage_[x.first].reset(copy_(x.second.get()));
     }
 
     virtual node_id new_node() const
     {
-        static node_id counter = 0;
-        return counter++;
+        return counter_++;
     }
 
     virtual std::shared_ptr<Node> load_node(const node_id & id) const
     {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex_);
         return std::shared_ptr<Node>(copy_(storage_.at(id).get()));
     }
 
     virtual void delete_node(const node_id & id)
     {
+        std::unique_lock<std::shared_timed_mutex> lock(mutex_);
         storage_.erase(id);
     }
 
     virtual void write_node(const node_id & id, Node * node)
     {
-        storage_[id].reset(copy_(node));
+        std::unique_ptr<Node> copy(copy_(node));
+        std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+        storage_[id] = std::move(copy);
     }
 
 private:
     std::unordered_map<node_id, std::unique_ptr<Node>> storage_;
     std::function<Node * (Node *)> copy_;
+    mutable std::atomic<node_id> counter_;
+    mutable std::shared_timed_mutex mutex_;
 };
 }
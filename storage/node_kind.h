@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include <tuple>
+#include <cstddef>
+
+namespace storage
+{
+// Type and level of a stored node, known from its serialized form
+struct node_kind
+{
+    std::string type;
+    std::size_t level;
+
+    bool operator<(const node_kind & other) const
+    {
+        return std::tie(type, level) < std::tie(other.type, other.level);
+    }
+};
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+namespace utils
+{
+// Histogram of latencies in nanoseconds with logarithmic buckets as in HdrHistogram:
+// every power of two range is split into 32 equal buckets, so values are kept with
+// relative error below 1/32 in fixed memory from 1 ns to the largest 64-bit value
+// Any other nonnegative integers, e.g. sizes, can be recorded as well
+struct latency_histogram
+{
+    latency_histogram()
+        : counts(bucket_count, 0)
+        , count_(0)
+        , sum(0)
+        , min_(std::numeric_limits<std::uint64_t>::max())
+        , max_(0)
+    {}
+
+    void record(std::uint64_t ns)
+    {
+        ++counts[index(ns)];
+        ++count_;
+        sum += ns;
+        min_ = std::min(min_, ns);
+        max_ = std::max(max_, ns);
+    }
+
+    void merge(const latency_histogram & other)
+    {
+        for (std::size_t i = 0; i < bucket_count; ++i)
+            counts[i] += other.counts[i];
+        count_ += other.count_;
+        sum += other.sum;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    void reset()
+    {
+        *this = latency_histogram();
+    }
+
+    std::uint64_t count() const
+    {
+        return count_;
+    }
+
+    std::uint64_t min() const
+    {
+        return count_ == 0 ? 0 : min_;
+    }
+
+    std::uint64_t max() const
+    {
+        return max_;
+    }
+
+    double mean() const
+    {
+        return count_ == 0 ? 0 : sum / count_;
+    }
+
+    // Smallest value that is not less than p percent of recorded values,
+    // up to the bucket width
+    std::uint64_t percentile(double p) const
+    {
+        if (count_ == 0)
+            return 0;
+
+        auto target = std::max<std::uint64_t>(1, std::uint64_t(std::ceil(p / 100 * count_)));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucket_count; ++i)
+        {
+            seen += counts[i];
+            if (seen >= target)
+                return std::min(max_, highest_equivalent(i));
+        }
+        return max_;
+    }
+
+private:
+    static constexpr std::size_t sub_bucket_bits = 5;
+    static constexpr std::size_t sub_bucket_count = 1 << sub_bucket_bits;
+    // Values below sub_bucket_count are exact, every further bit of magnitude takes sub_bucket_count buckets
+    static constexpr std::size_t bucket_count = (64 - sub_bucket_bits + 1) * sub_bucket_count;
+
+    static std::size_t index(std::uint64_t ns)
+    {
+        if (ns < sub_bucket_count)
+            return ns;
+        std::size_t shift = 63 - __builtin_clzll(ns) - sub_bucket_bits;
+        return (shift + 1) * sub_bucket_count + (ns >> shift) - sub_bucket_count;
+    }
+
+    static std::uint64_t highest_equivalent(std::size_t i)
+    {
+        if (i < sub_bucket_count)
+            return i;
+        std::size_t shift = i / sub_bucket_count - 1;
+        std::uint64_t lowest = std::uint64_t(i % sub_bucket_count + sub_bucket_count) << shift;
+        return lowest + ((std::uint64_t(1) << shift) - 1);
+    }
+
+    std::vector<std::uint64_t> counts;
+    std::uint64_t count_;
+    double sum;
+    std::uint64_t min_;
+    std::uint64_t max_;
+};
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "latency.h"
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <mutex>
+
+// Probes measure latency of heap operations and tree events and sizes of events
+// (number of elements moved by them). They are compiled in only if HEAP_PROBES
+// is defined (cmake -DHEAP_PROBES=ON), otherwise HEAP_PROBE(event) and
+// HEAP_PROBE_SIZE(event, size) expand to nothing.
+#ifdef HEAP_PROBES
+#define HEAP_PROBE_CONCAT_(a, b) a##b
+#define HEAP_PROBE_CONCAT(a, b) HEAP_PROBE_CONCAT_(a, b)
+#define HEAP_PROBE(event) utils::probe_scope HEAP_PROBE_CONCAT(heap_probe_, __LINE__)(utils::probe_event::event)
+#define HEAP_PROBE_SIZE(event, size) utils::probe_size(utils::probe_event::event, size)
+#else
+#define HEAP_PROBE(event) do {} while (false)
+#define HEAP_PROBE_SIZE(event, size) do {} while (false)
+#endif
+
+namespace utils
+{
+enum class probe_event
+{
+    heap_add,
+    heap_remove_min,
+    // Emptying of a tree buffer to its children
+    flush,
+    // Split of a full tree node
+    split,
+    // Merge of a tree node with its brother
+    merge,
+    // Move of elements from the tree to the small set of the heap
+    refill,
+    // Move of elements from the small set of the heap to the tree
+    spill,
+    count
+};
+
+inline const char * probe_name(probe_event e)
+{
+    static const char * names[] = { "heap_add", "heap_remove_min", "flush", "split", "merge", "refill", "spill" };
+    return names[static_cast<std::size_t>(e)];
+}
+
+// Callbacks called when a probed event begins and ends, end gets its duration
+// Events nest: split happens inside flush, flush inside heap_add and so on
+struct probe_hooks
+{
+    std::function<void(probe_event)> begin;
+    std::function<void(probe_event, std::chrono::nanoseconds)> end;
+};
+
+struct probe_registry
+{
+    std::mutex mutex;
+    probe_hooks hooks;
+    std::array<latency_histogram, static_cast<std::size_t>(probe_event::count)> histograms;
+    std::array<latency_histogram, static_cast<std::size_t>(probe_event::count)> sizes;
+};
+
+inline probe_registry & probes()
+{
+    static probe_registry registry;
+    return registry;
+}
+
+// Hooks are shared by all threads and should be set while no probed operation runs
+inline void set_probe_hooks(const probe_hooks & hooks)
+{
+    std::lock_guard<std::mutex> lock(probes().mutex);
+    probes().hooks = hooks;
+}
+
+inline latency_histogram probe_histogram(probe_event e)
+{
+    std::lock_guard<std::mutex> lock(probes().mutex);
+    return probes().histograms[static_cast<std::size_t>(e)];
+}
+
+// Histogram of sizes recorded for the event, e.g. numbers of elements in flushed buffers
+inline latency_histogram probe_size_histogram(probe_event e)
+{
+    std::lock_guard<std::mutex> lock(probes().mutex);
+    return probes().sizes[static_cast<std::size_t>(e)];
+}
+
+inline void probe_size(probe_event e, std::uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(probes().mutex);
+    probes().sizes[static_cast<std::size_t>(e)].record(size);
+}
+
+inline void reset_probe_histograms()
+{
+    std::lock_guard<std::mutex> lock(probes().mutex);
+    for (auto & h : probes().histograms)
+        h.reset();
+    for (auto & h : probes().sizes)
+        h.reset();
+}
+
+// Records latency of the event from construction to destruction to its histogram
+struct probe_scope
+{
+    probe_scope(probe_event e)
+        : e(e)
+    {
+        if (probes().hooks.begin)
+            probes().hooks.begin(e);
+        start = std::chrono::steady_clock::now();
+    }
+
+    probe_scope(const probe_scope & other) = delete;
+
+    ~probe_scope()
+    {
+        auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        {
+            std::lock_guard<std::mutex> lock(probes().mutex);
+            probes().histograms[static_cast<std::size_t>(e)].record(duration.count());
+        }
+        if (probes().hooks.end)
+            probes().hooks.end(e, duration);
+    }
+
+private:
+    probe_event e;
+    std::chrono::steady_clock::time_point start;
+};
+}
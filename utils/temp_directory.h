@@ -0,0 +1,33 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+
+namespace utils
+{
+// Directory with a unique name inside parent, created with parent if needed and removed
+// with its contents on destruction; other files of parent are never touched
+struct temp_directory
+{
+    explicit temp_directory(const boost::filesystem::path & parent)
+        : path_(parent / boost::filesystem::unique_path("tmp-%%%%-%%%%-%%%%"))
+    {
+        boost::filesystem::create_directories(path_);
+    }
+
+    temp_directory(const temp_directory & other) = delete;
+
+    ~temp_directory()
+    {
+        boost::system::error_code ignored;
+        boost::filesystem::remove_all(path_, ignored);
+    }
+
+    const boost::filesystem::path & path() const
+    {
+        return path_;
+    }
+
+private:
+    boost::filesystem::path path_;
+};
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+namespace utils
+{
+// Fixed-size pool of worker threads
+// run() executes a batch of tasks and returns when all of them are done
+struct thread_pool
+{
+    thread_pool(std::size_t threads_count = std::thread::hardware_concurrency())
+        : stopped(false)
+    {
+        if (threads_count == 0)
+            threads_count = 1;
+        for (std::size_t i = 0; i < threads_count; ++i)
+            workers.emplace_back([this] () { this->work(); });
+    }
+
+    thread_pool(const thread_pool & other) = delete;
+
+    void run(std::vector<std::function<void()>> & tasks)
+    {
+        std::size_t remaining = tasks.size();
+        std::exception_ptr error;
+        std::condition_variable done;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            for (auto & task : tasks)
+                queue.push([&task, &remaining, &error, &done, this] ()
+                {
+                    std::exception_ptr e;
+                    try
+                    {
+                        task();
+                    }
+                    catch (...)
+                    {
+                        e = std::current_exception();
+                    }
+
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (e && !error)
+                        error = e;
+                    if (--remaining == 0)
+                        done.notify_all();
+                });
+            has_work.notify_all();
+            done.wait(lock, [&remaining] () { return remaining == 0; });
+        }
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    std::size_t size() const
+    {
+        return workers.size();
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped = true;
+        }
+        has_work.notify_all();
+        for (auto & worker : workers)
+            worker.join();
+    }
+
+private:
+    void work()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                has_work.wait(lock, [this] () { return stopped || !queue.empty(); });
+                if (stopped && queue.empty())
+                    return;
+                task = std::move(queue.front());
+                queue.pop();
+            }
+            task();
+        }
+    }
+
+    bool stopped;
+    std::mutex mutex_;
+    std::condition_variable has_work;
+    std::queue<std::function<void()>> queue;
+    std::vector<std::thread> workers;
+};
+}